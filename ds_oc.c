@@ -2,152 +2,4008 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/usb.h>
+#include <linux/usb/hcd.h>
+#include <linux/ktime.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/list.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/hashtable.h>
+#include <linux/rcupdate.h>
+#include <linux/math64.h>
+#include <linux/workqueue.h>
+#include <linux/kprobes.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/miscdevice.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/pm_qos.h>
+#include <linux/hid.h>
+#include <linux/hidraw.h>
+#include <linux/input.h>
+#include <linux/suspend.h>
+#include <linux/pm_runtime.h>
+#include <linux/kobject.h>
+#include <linux/sysfs.h>
 
-#define WMO_VID 0x054c
-#define WMO_PID 0x0ce6
+#include "ds_oc_ring.h"
+
+#define CREATE_TRACE_POINTS
+#include "ds_oc_trace.h"
+
+#define SONY_VID 0x054c
+
+/* Most Sony controllers expose their HID reports on interface 3 through these endpoints. Only used as a hint, see take_snapshot. */
+#define DEFAULT_IFNUM 3
+#define DEFAULT_EP_IN 0x84
+#define DEFAULT_EP_OUT 0x03
+
+/* Full- and low-speed intervals count 1 ms frames, faster links use an exponent over 125 us microframes. */
+#define FRAME_RATE_HZ 1000
+#define MICROFRAME_RATE_HZ 8000
+#define MAX_MICROFRAME_INTERVAL 16
+
+/*
+ * Inter-report times are kept in a log-linear histogram in microseconds: one bucket per microsecond below 16 us,
+ * then 8 buckets per power of two. Times of a second or more end up in the last bucket.
+ */
+#define HIST_LINEAR_BUCKETS 16
+#define HIST_SUB_BUCKETS 8
+#define HIST_MAX_US (1 << 20)
+#define HIST_BUCKETS (HIST_LINEAR_BUCKETS + (20 - 4) * HIST_SUB_BUCKETS)
+
+/* A measured rate of at least this share of the requested rate counts as achieved. */
+#define VERIFY_ACHIEVED_PERCENT 90
+
+/* Share of the bus time USB 2.0 allows periodic transfers to take, per high-speed microframe and per full-speed frame. */
+#define PERIODIC_LIMIT_HIGH_SPEED 80
+#define PERIODIC_LIMIT_FULL_SPEED 90
+
+/* How often the demand mode checks whether anything has a controller open. */
+#define DEMAND_POLL_MS 500
+
+/* Controllers whose settings are remembered across replugs, the least recently seen one is forgotten first. */
+#define POLICY_MAX_ENTRIES 32
+/* vid:pid plus the serial number, or the bus path for controllers without one. */
+#define POLICY_KEY_LEN 80
+
+/* Auto-tuning steps through at most one candidate per bInterval exponent. */
+#define TUNE_MAX_STEPS MAX_MICROFRAME_INTERVAL
+/* Time the host controller gets to settle on a new interval before reports are counted. */
+#define TUNE_SETTLE_MS 100
+/* A faster interval is only chosen if it delivers at least this many percent more unique reports. */
+#define TUNE_GAIN_PERCENT 5
+
+/* Per-direction rate override that keeps the endpoint at its original interval. */
+#define RATE_ORIGINAL UINT_MAX
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Jiang lai");
 MODULE_DESCRIPTION("Filter kernel module to set the polling rate of the Sony DualSense controller to a custom value on XHCI.");
 MODULE_VERSION("1.0");
 
-static struct usb_device* adapter_device = NULL;
+enum apply_mode {
+	/* Follow the strategy chosen for the host controller of the device. */
+	APPLY_MODE_AUTO,
+	APPLY_MODE_RESELECT,
+	APPLY_MODE_RESET,
+	/* Only patch the descriptors, they take effect the next time the interface driver binds. */
+	APPLY_MODE_NONE,
+	/* Unbind and rebind the driver of the patched interface, leaving the other interfaces of the device alone. */
+	APPLY_MODE_REBIND
+};
+
+static const char* const apply_mode_names[] = { "auto", "reselect", "reset", "none", "rebind" };
+
+enum apply_path {
+	APPLY_PATH_NONE,
+	APPLY_PATH_RESELECT,
+	APPLY_PATH_RESET,
+	APPLY_PATH_DESCRIPTOR,
+	/* Patched before the interface drivers bound, nothing had to be applied. */
+	APPLY_PATH_EARLY,
+	APPLY_PATH_REBIND
+};
+
+static const char* const apply_path_names[] = { "none", "reselect", "reset", "descriptor", "early", "rebind" };
+
+/* Strategy per host controller driver, matched by the prefix of hc_driver->description. */
+struct hcd_strategy {
+	const char* prefix;
+	int mode;
+};
+
+static const struct hcd_strategy hcd_strategies[] = {
+	/* xHCI computes the endpoint interval from the descriptor whenever an endpoint is added, re-adding the interface is enough. */
+	{ "xhci", APPLY_MODE_RESELECT },
+	/*
+	 * EHCI, OHCI and UHCI schedule interrupt transfers with the interval the interface driver submits its URBs with.
+	 * usbhid takes it from the descriptor when it binds and keeps it across re-selects, so only binding it again helps.
+	 */
+	{ "ehci", APPLY_MODE_REBIND },
+	{ "ohci", APPLY_MODE_REBIND },
+	{ "uhci", APPLY_MODE_REBIND }
+};
+
+/* Used for host controllers not in hcd_strategies. A reset re-adds every endpoint no matter how the controller schedules them. */
+#define DEFAULT_HCD_MODE APPLY_MODE_RESET
+
+enum device_status {
+	DEVICE_STATUS_CONNECTED,
+	DEVICE_STATUS_PATCHED,
+	DEVICE_STATUS_FAILED,
+	DEVICE_STATUS_UNSUPPORTED,
+	DEVICE_STATUS_DISCONNECTED
+};
+
+static const char* const device_status_names[] = { "connected", "patched", "failed", "unsupported", "disconnected" };
+
+enum endpoint_dir {
+	ENDPOINT_IN,
+	ENDPOINT_OUT,
+	ENDPOINT_DIRS
+};
+
+enum verify_result {
+	VERIFY_NONE,
+	VERIFY_PENDING,
+	VERIFY_ACHIEVED,
+	VERIFY_DEGRADED,
+	VERIFY_FAILED,
+	VERIFY_IDLE
+};
+
+static const char* const verify_result_names[] = { "none", "pending", "achieved", "degraded", "failed", "idle" };
+
+enum tune_state {
+	TUNE_NONE,
+	TUNE_RUNNING,
+	TUNE_DONE,
+	TUNE_IDLE,
+	TUNE_FAILED
+};
+
+static const char* const tune_state_names[] = { "none", "running", "done", "idle", "failed" };
+
+enum tune_phase {
+	/* Patch the next candidate. */
+	TUNE_PHASE_APPLY,
+	/* The candidate settled, start counting. */
+	TUNE_PHASE_START,
+	/* Counting finished, record the result. */
+	TUNE_PHASE_MEASURE
+};
+
+/* One measured point of the auto-tuning curve. */
+struct tune_point {
+	unsigned short interval;
+	unsigned int hz;
+	unsigned int reports_hz;
+	/* Reports whose sequence byte differs from the previous one, i.e. reports with new data. */
+	unsigned int unique_hz;
+};
+
+/* Describes which endpoints of a matched controller get patched. */
+struct device_layout {
+	u8 ifnum;
+	u8 ep_in;
+	u8 ep_out;
+};
+
+struct match_entry {
+	struct hlist_node node;
+	struct rcu_head rcu;
+	u16 vid;
+	u16 pid;
+	struct device_layout layout;
+};
+
+static const struct {
+	u16 vid;
+	u16 pid;
+	const char* name;
+} builtin_matches[] = {
+	{ SONY_VID, 0x0ce6, "DualSense" },
+	{ SONY_VID, 0x0df2, "DualSense Edge" },
+	{ SONY_VID, 0x05c4, "DualShock 4" },
+	{ SONY_VID, 0x09cc, "DualShock 4 (2nd generation)" }
+};
+
+/* Built-in entries removed with the match parameter at load time, before the table was seeded with them. */
+static bool builtin_removed[ARRAY_SIZE(builtin_matches)];
+
+/* Keyed by VID and PID so the notifier can match every USB device on the system in constant time. Readers use RCU. */
+static DEFINE_HASHTABLE(match_table, 6);
+static DEFINE_MUTEX(match_table_lock);
+
+/* Original state of one patched endpoint descriptor. */
+struct endpoint_snapshot {
+	struct usb_interface* interface;
+	struct usb_endpoint_descriptor* desc;
+	u8 altsetting;
+	u8 dir;
+	u8 interval;
+};
+
+/* Inter-report statistics of one CPU, only written from the URB completion path on that CPU. */
+struct report_stats {
+	u64 count;
+	u64 sum_us;
+	u32 min_us;
+	u32 max_us;
+	u32 buckets[HIST_BUCKETS];
+};
+
+/* Raw report timestamps exported read-only to userspace through a character device, see ds_oc_ring.h. */
+struct report_ring {
+	struct kref kref;
+	struct miscdevice misc;
+	char name[32];
+	char nodename[40];
+	/* vmalloc_user() area: the header page followed by the entries. */
+	struct ds_oc_ring_header* header;
+	struct ds_oc_ring_entry* entries;
+	size_t size;
+	/* Only written by the URB completion path, see record_report. */
+	u64 head;
+};
+
+/* Watches the completions of the interrupt IN endpoint of a patched device. Looked up by the kprobe under RCU. */
+struct report_monitor {
+	struct hlist_node node;
+	struct rcu_head rcu;
+	struct usb_device* udev;
+	u8 endpoint;
+	struct report_stats __percpu* stats;
+	struct report_ring* ring;
+	/* Completions of one endpoint are serialized by the host controller, so these only have a single writer. */
+	u64 first_ns;
+	u64 last_ns;
+	/* Unlike stats these are never cleared, measurements take the difference of two readings. */
+	u64 reports;
+	u64 unique_reports;
+	u8 last_seq;
+	/* Whether the endpoint runs faster than its original interval, only those reports keep the CPU latency request alive. */
+	bool overclocked;
+	/* Set around resets issued by the module itself, reset_seen when somebody else reset the device. */
+	bool self_reset;
+	bool reset_seen;
+	struct dentry* debugfs_dir;
+};
+
+/* State kept for every matched controller. Entries are refcounted so they can be used without holding device_list_lock. */
+struct ds_oc_device {
+	struct list_head list;
+	struct kref kref;
+	struct usb_device* udev;
+	struct device_layout layout;
+	/* Serializes patching and restoring the descriptors of this device. */
+	struct mutex lock;
+	/* Set once the device is disconnected, pending work must not touch it anymore. Protected by lock. */
+	bool removed;
+
+	/* Patches the device to the configured rates. Holds a reference while queued. */
+	struct delayed_work apply_work;
+	/* Number of rate changes that were folded into an already pending patch. */
+	unsigned int coalesced;
+	ktime_t added_at;
+	/* Time from hotplug (or module load) until the device was first patched. */
+	unsigned int hotplug_us;
+
+	/* Report statistics of the input endpoint, created once the endpoints are known. Protected by lock. */
+	struct report_monitor* monitor;
+
+	/* Every patched endpoint of every altsetting as it was before the first patch, grouped by interface. */
+	struct endpoint_snapshot* snapshots;
+	unsigned int num_snapshots;
+
+	unsigned short interval[ENDPOINT_DIRS];
+	unsigned int rate_hz[ENDPOINT_DIRS];
+	int status;
+	int apply_path;
+	unsigned int apply_us;
+	/*
+	 * Intervals requested by the configuration and the ones the bandwidth planner granted, in the format of patch_endpoints.
+	 * xfer_ns is the bus time of one transaction of the largest endpoint per direction, 0 until the snapshot is taken.
+	 */
+	unsigned short requested[ENDPOINT_DIRS];
+	unsigned short planned[ENDPOINT_DIRS];
+	unsigned int xfer_ns[ENDPOINT_DIRS];
+
+	/*
+	 * Hub whose transaction translator carries the traffic of a full- or low-speed device on a high-speed bus, NULL if there is none.
+	 * tt_port is the port of a multi-TT hub, 0 on a single-TT hub where all ports share one translator.
+	 * tt_xfer_ns is the full-speed time of one transaction through it, while xfer_ns holds the time of the split transaction on the bus.
+	 */
+	struct usb_device* tt_hub;
+	int tt_port;
+	unsigned int tt_xfer_ns[ENDPOINT_DIRS];
+
+	/* Driver of the host controller the device is connected to and the apply mode chosen for it. */
+	char hcd_name[16];
+	int hcd_mode;
+
+	/* Measures the report rate for verify_ms after every applied patch. Holds a reference while queued. */
+	struct delayed_work verify_work;
+	int verify_result;
+	u64 verify_reports;
+	u64 verify_start_ns;
+	/* Whether the device was delivering reports right before the patch. */
+	bool verify_active;
+	unsigned int achieved_hz;
+	/* Intervals of the last patch that kept reports flowing, in the format of patch_endpoints. Starts out as the original ones. */
+	unsigned short good_interval[ENDPOINT_DIRS];
+	/* Set while the device runs on good_interval after a failed patch, so a failing fallback is not retried forever. */
+	bool in_fallback;
+	/*
+	 * Intervals the configuration asks for, before demand mode or a fallback replaced them. failed_interval holds the configured
+	 * intervals whose patch stopped reports, has_failed keeps the device on good_interval until another rate is configured.
+	 */
+	unsigned short configured[ENDPOINT_DIRS];
+	unsigned short failed_interval[ENDPOINT_DIRS];
+	bool has_failed;
+	/* Set while the module is unloading, the original intervals are restored and must not be verified. */
+	bool restoring;
+
+	/*
+	 * Set after a system resume or a foreign reset until the next patch checked the descriptors. verify_revalidate makes the
+	 * measurement that follows reapply the rate if it is not achieved, force_apply applies even unchanged descriptors.
+	 */
+	bool revalidate;
+	bool verify_revalidate;
+	bool force_apply;
+	/* How often the rate had to be reapplied after it was lost. */
+	unsigned int reapplied;
+
+	/* Checks every DEMAND_POLL_MS whether a reader has the controller open while demand is set. Holds a reference while queued. */
+	struct delayed_work demand_work;
+	/* Whether the controller counts as in use, which lasts demand_idle_ms past the last reader closing it. */
+	bool in_use;
+	u64 last_use_ns;
+
+	/* Steps through tune_curve when rate=auto. Holds a reference while queued. */
+	struct delayed_work tune_work;
+	int tune_state;
+	int tune_phase;
+	/* Value of tune_generation the curve was measured for. */
+	unsigned int tune_generation;
+	unsigned int tune_step;
+	unsigned int tune_steps;
+	u64 tune_reports;
+	u64 tune_unique;
+	u64 tune_start_ns;
+	/* Ordered from the original interval to the fastest one. */
+	struct tune_point tune_curve[TUNE_MAX_STEPS];
+	/* Input interval chosen by auto-tuning, 0 keeps the original interval. */
+	unsigned short tuned_interval;
+
+	/*
+	 * The ds_oc directory under the USB device in sysfs. Holds a reference while added, which its release drops.
+	 * rate_hz_override replaces rate/rate_hz for this device: 0 follows them, RATE_ORIGINAL keeps the original intervals.
+	 */
+	struct kobject kobj;
+	bool kobj_added;
+	unsigned int rate_hz_override;
+	/* Resets issued by the module to apply a rate. */
+	unsigned int resets;
+};
+
+static LIST_HEAD(device_list);
+static DEFINE_MUTEX(device_list_lock);
+
+/* Keyed by the usb_device pointer, the kprobe on the URB completion path looks up monitors under RCU. */
+static DEFINE_HASHTABLE(monitor_table, 5);
+static DEFINE_MUTEX(monitor_table_lock);
+static struct dentry* debugfs_root = NULL;
+
+/* All patching happens here so neither the USB notifier chain nor module loading waits for a device reset. */
+static struct workqueue_struct* apply_wq = NULL;
 
-static unsigned short restore_interval = 8;
 static unsigned short configured_interval = 1;
+/* Polling rate in Hz, takes precedence over configured_interval when not 0. */
+static unsigned int configured_rate_hz = 0;
+/* Per-direction rates in Hz indexed by enum endpoint_dir. 0 follows rate/rate_hz, RATE_ORIGINAL keeps the original interval. */
+static unsigned int configured_dir_hz[ENDPOINT_DIRS] = { 0, 0 };
+static int apply_mode = APPLY_MODE_AUTO;
+/* Rate changes within this window are applied with a single patch per device. */
+static unsigned int coalesce_ms = 250;
+/* Length of the measurement after each patch, 0 disables verification. */
+static unsigned int verify_ms = 1000;
+/* Set by writing "auto" to the rate parameter. Every such write bumps tune_generation so all controllers are tuned again. */
+static bool autotune = false;
+static unsigned int tune_generation = 0;
+/* Length of the measurement of each auto-tuning candidate. */
+static unsigned int autotune_ms = 500;
+/* Percentage of the periodic bandwidth of each bus the managed controllers may use together, 0 disables planning. */
+static unsigned int bandwidth_pct = 50;
+/* CPU latency bound held while an overclocked controller delivers reports, negative disables the request. */
+static int qos_latency_us = -1;
+/* The request is dropped once no overclocked controller delivered a report for this long. */
+static unsigned int qos_idle_ms = 5000;
+/* Patch matched devices from a device driver probe, before the interface drivers bind. */
+static bool early_patch = true;
+/* Keep controllers at their original interval unless a reader has their hidraw or input device open. */
+static bool demand = false;
+static unsigned int demand_idle_ms = 10000;
 
-/* Patches all applicable endpoints. Returns the bInterval value used before patching. */
-static unsigned short patch_endpoints(unsigned short interval) {
-	static unsigned short old_interval = 8;
+static void release_device(struct kref* kref) {
+	struct ds_oc_device* dev = container_of(kref, struct ds_oc_device, kref);
 
-	if(adapter_device != NULL && adapter_device->actconfig != NULL) {
-		struct usb_interface* interface = adapter_device->actconfig->interface[3];
+	usb_put_dev(dev->udev);
+	kfree(dev->snapshots);
+	kfree(dev);
+}
 
-		if(interface != NULL) {
-			for(unsigned int altsetting = 0; altsetting < interface->num_altsetting; altsetting++) {
-				struct usb_host_interface* altsettingptr = &interface->altsetting[altsetting];
+static void put_device_state(struct ds_oc_device* dev) {
+	kref_put(&dev->kref, &release_device);
+}
 
-				for(__u8 endpoint = 0; endpoint < altsettingptr->desc.bNumEndpoints; endpoint++) {
-					if(altsettingptr->endpoint[endpoint].desc.bEndpointAddress == 0x84 || altsettingptr->endpoint[endpoint].desc.bEndpointAddress == 0x03) {
-						old_interval = altsettingptr->endpoint[endpoint].desc.bInterval;
-						altsettingptr->endpoint[endpoint].desc.bInterval = interval;
+/*
+ * Re-selects the current altsetting of the interface so the host controller drops and re-adds its endpoints using the patched descriptors.
+ * The bound driver is quiesced and restarted through its pre_reset/post_reset callbacks, just like usb_reset_device() does,
+ * but the device itself stays on the bus and none of its other interfaces are touched.
+ * The caller must hold the device lock.
+ */
+static int reselect_interface(struct usb_device* device, struct usb_interface* interface) {
+	struct usb_host_interface* altsettingptr = interface->cur_altsetting;
+	struct usb_driver* driver = NULL;
+	int ret;
 
-						printk(KERN_INFO "ds_oc: bInterval value of endpoint 0x%.2x set to %u.\n", altsettingptr->endpoint[endpoint].desc.bEndpointAddress, interval);
-					}
-				}
-			}
+	if(interface->dev.driver != NULL) {
+		driver = to_usb_driver(interface->dev.driver);
 
-			/*
-			 * Attempt to lock the device.
-			 * This is required by the kernel documentation but it seems that some systems won't let you lock the USB device.
-			 * Older versions before 1.2 never called this function and still worked so we proceed even if locking fails.
-			 */
-			int ret = usb_lock_device_for_reset(adapter_device, NULL);
-			if(ret) {
-				printk(KERN_ERR "ds_oc: Warning! Failed to acquire lock for USB device (error: %d). Resetting device anyway...\n", ret);
-			}
-			/* TODO: It might be possible to make the new bInterval value take effect without calling usb_reset_device? */
-			if(usb_reset_device(adapter_device)) {
-				printk(KERN_ERR "ds_oc: Could not reset device (error: %d). bInterval value was NOT changed.\n", ret);
-			}
-			/* Only unlock the device if usb_lock_device_for_reset succeeded. */
-			if(!ret) {
-				usb_unlock_device(adapter_device);
-			}
+		/* Drivers without reset callbacks would have to be unbound, which is what the reset path is for. */
+		if(driver->pre_reset == NULL || driver->post_reset == NULL) {
+			return -EOPNOTSUPP;
 		}
 	}
 
-	return old_interval;
+	ret = usb_autopm_get_interface(interface);
+	if(ret) {
+		return ret;
+	}
+
+	if(driver != NULL) {
+		ret = driver->pre_reset(interface);
+		if(ret) {
+			usb_autopm_put_interface(interface);
+			return ret;
+		}
+	}
+
+	ret = usb_set_interface(device, altsettingptr->desc.bInterfaceNumber, altsettingptr->desc.bAlternateSetting);
+
+	if(driver != NULL) {
+		int post_ret = driver->post_reset(interface);
+		if(!ret) {
+			ret = post_ret;
+		}
+	}
+
+	usb_autopm_put_interface(interface);
+
+	return ret;
 }
 
-static int on_usb_notify(struct notifier_block* self, unsigned long action, void* _device) {
-	struct usb_device* device = _device;
+/*
+ * Unbinds the driver of the interface, re-selects its altsetting so the host controller re-adds the endpoints and binds the driver again.
+ * The new driver instance allocates its URBs with the patched intervals. Only this interface goes away for the duration, the
+ * device stays configured and its other interfaces keep running, unlike with usb_reset_device().
+ * The caller must hold the device lock, the same way usb_reset_device() rebinds the interfaces it had to unbind.
+ */
+static int rebind_interface(struct usb_device* device, struct usb_interface* interface) {
+	struct usb_host_interface* altsettingptr;
+	int ret;
 
-	switch(action) {
-		case USB_DEVICE_ADD:
-			if(device->descriptor.idVendor == WMO_VID && device->descriptor.idProduct == WMO_PID && adapter_device == NULL) {
-				adapter_device = device;
-				printk(KERN_INFO "ds_oc: Overclockable mouse connected\n");
+	/*
+	 * Unbinding resets the runtime PM state of the interface and probing sets it up again, so a reference taken on the interface
+	 * would not pair up. Keep the device awake instead, like usb_reset_device() does around its unbind and rebind.
+	 */
+	ret = pm_runtime_resume_and_get(&device->dev);
+	if(ret) {
+		return ret;
+	}
 
-				restore_interval = patch_endpoints(configured_interval);
+	if(interface->dev.driver != NULL) {
+		usb_driver_release_interface(to_usb_driver(interface->dev.driver), interface);
+	}
+
+	/* Unbinding may have switched the interface back to altsetting 0. */
+	altsettingptr = interface->cur_altsetting;
+	ret = usb_set_interface(device, altsettingptr->desc.bInterfaceNumber, altsettingptr->desc.bAlternateSetting);
+
+	/* Bind even if the re-select failed, leaving the interface without a driver would be worse than an unchanged rate. */
+	if(device_attach(&interface->dev) < 0 && !ret) {
+		ret = -ENODEV;
+	}
+
+	pm_runtime_put(&device->dev);
+
+	return ret;
+}
+
+/* Returns the apply mode for the device. APPLY_MODE_AUTO resolves to the strategy of its host controller. */
+static int device_apply_mode(struct ds_oc_device* dev) {
+	return apply_mode == APPLY_MODE_AUTO ? dev->hcd_mode : apply_mode;
+}
+
+/*
+ * Makes the patched descriptors take effect. Returns the path that was used or APPLY_PATH_NONE on failure.
+ * lock_ret is the result of usb_lock_device_for_reset, the device is only guaranteed to be locked if it is 0.
+ */
+static int apply_endpoints(struct ds_oc_device* dev, int lock_ret) {
+	int mode = device_apply_mode(dev);
+	int path = APPLY_PATH_NONE;
+
+	/* Switching rates on demand must not disconnect the game that just opened the controller, so it never resets or rebinds. */
+	bool may_reset = apply_mode != APPLY_MODE_RESELECT && apply_mode != APPLY_MODE_REBIND && !demand;
+
+	if(demand && mode == APPLY_MODE_REBIND) {
+		mode = APPLY_MODE_NONE;
+	}
+
+	if(mode == APPLY_MODE_NONE) {
+		return APPLY_PATH_DESCRIPTOR;
+	}
+
+	if(demand && mode == APPLY_MODE_RESET) {
+		mode = APPLY_MODE_RESELECT;
+	}
+
+	/* Binding needs the lock as well, the reset below is the only path that works without it. */
+	if(mode == APPLY_MODE_REBIND && !lock_ret) {
+		u64 begin = ktime_get_ns();
+		int ret = 0;
+
+		trace_ds_oc_reset_begin(dev_name(&dev->udev->dev), apply_path_names[APPLY_PATH_REBIND]);
+		for(unsigned int i = 0; i < dev->num_snapshots && !ret; i++) {
+			if(i == 0 || dev->snapshots[i].interface != dev->snapshots[i - 1].interface) {
+				ret = rebind_interface(dev->udev, dev->snapshots[i].interface);
 			}
-			break;
+		}
+		trace_ds_oc_reset_end(dev_name(&dev->udev->dev), apply_path_names[APPLY_PATH_REBIND], ret, ktime_get_ns() - begin);
 
-		case USB_DEVICE_REMOVE:
-			if(adapter_device == device) {
-				adapter_device = NULL;
-				printk(KERN_INFO "ds_oc: Overclockable mouse disconnected\n");
+		if(!ret) {
+			path = APPLY_PATH_REBIND;
+		}
+		else if(!may_reset) {
+			printk(KERN_ERR "ds_oc: Could not rebind interface (error: %d). bInterval value was NOT changed.\n", ret);
+		}
+		else {
+			printk(KERN_WARNING "ds_oc: Could not rebind interface (error: %d). Falling back to resetting the device...\n", ret);
+		}
+	}
+
+	/* Re-selecting the altsetting is only safe while we hold the lock, otherwise the interface driver could change underneath us. */
+	if(mode == APPLY_MODE_RESELECT && !lock_ret) {
+		u64 begin = ktime_get_ns();
+		int ret = 0;
+
+		trace_ds_oc_reset_begin(dev_name(&dev->udev->dev), apply_path_names[APPLY_PATH_RESELECT]);
+		/* Snapshots are grouped by interface, re-select each patched interface once. */
+		for(unsigned int i = 0; i < dev->num_snapshots && !ret; i++) {
+			if(i == 0 || dev->snapshots[i].interface != dev->snapshots[i - 1].interface) {
+				ret = reselect_interface(dev->udev, dev->snapshots[i].interface);
 			}
-			break;
+		}
+		trace_ds_oc_reset_end(dev_name(&dev->udev->dev), apply_path_names[APPLY_PATH_RESELECT], ret, ktime_get_ns() - begin);
+
+		if(!ret) {
+			path = APPLY_PATH_RESELECT;
+		}
+		else if(!may_reset) {
+			printk(KERN_ERR "ds_oc: Could not re-select interface (error: %d). bInterval value was NOT changed.\n", ret);
+		}
+		else {
+			printk(KERN_WARNING "ds_oc: Could not re-select interface (error: %d). Falling back to resetting the device...\n", ret);
+		}
 	}
 
-	return NOTIFY_OK;
+	/* Without the lock only a reset is possible, which an explicit apply=reselect or apply=rebind and demand rule out. */
+	if(path == APPLY_PATH_NONE && !may_reset && lock_ret && mode != APPLY_MODE_RESET) {
+		printk(KERN_ERR "ds_oc: Could not lock %s to apply by %s. bInterval value was NOT changed.\n", dev_name(&dev->udev->dev), apply_mode_names[mode]);
+	}
+
+	/* Only an explicit apply=reselect or apply=rebind and demand rule out the reset, the strategy of the host controller falls back to it. */
+	if(path == APPLY_PATH_NONE && may_reset) {
+		u64 begin = ktime_get_ns();
+		int ret;
+
+		if(dev->monitor != NULL) {
+			WRITE_ONCE(dev->monitor->self_reset, true);
+		}
+
+		trace_ds_oc_reset_begin(dev_name(&dev->udev->dev), apply_path_names[APPLY_PATH_RESET]);
+		ret = usb_reset_device(dev->udev);
+		trace_ds_oc_reset_end(dev_name(&dev->udev->dev), apply_path_names[APPLY_PATH_RESET], ret, ktime_get_ns() - begin);
+
+		if(dev->monitor != NULL) {
+			WRITE_ONCE(dev->monitor->self_reset, false);
+		}
+
+		if(ret) {
+			printk(KERN_ERR "ds_oc: Could not reset device (error: %d). bInterval value was NOT changed.\n", ret);
+		}
+		else {
+			dev->resets++;
+			path = APPLY_PATH_RESET;
+		}
+	}
+
+	return path;
 }
 
-static struct notifier_block usb_nb = { .notifier_call = on_usb_notify };
+static bool uses_microframes(struct usb_device* device) {
+	return device->speed >= USB_SPEED_HIGH;
+}
 
-static int usb_device_cb(struct usb_device* device, void* data) {
-	if(device->descriptor.idVendor == WMO_VID && device->descriptor.idProduct == WMO_PID && adapter_device == NULL) {
-		adapter_device = device;
-		printk(KERN_INFO "ds_oc: wheel mouse optical connected\n");
+/* Returns the polling rate in Hz the bInterval value results in on the link speed of the device. */
+static unsigned int interval_to_hz(struct usb_device* device, unsigned short interval) {
+	if(interval == 0) {
+		return 0;
+	}
 
-		restore_interval = patch_endpoints(configured_interval);
+	if(uses_microframes(device)) {
+		return MICROFRAME_RATE_HZ >> (min_t(unsigned short, interval, MAX_MICROFRAME_INTERVAL) - 1);
 	}
 
-	return 0;
+	/* Host controllers round full-speed periods down to a power of two. */
+	return FRAME_RATE_HZ >> (fls(min_t(unsigned short, interval, 255)) - 1);
 }
 
-static int __init on_module_init(void) {
-	if(configured_interval > 255) {
-		printk(KERN_WARNING "ds_oc: Invalid interval parameter specified.\n");
-		configured_interval = 255;
+/* Returns the polling period in ns the bInterval value results in. Unlike the rate in Hz it never rounds down to 0. */
+static u64 interval_to_period_ns(struct usb_device* device, unsigned short interval) {
+	if(uses_microframes(device)) {
+		return (u64)(NSEC_PER_SEC / MICROFRAME_RATE_HZ) << (clamp_t(unsigned short, interval, 1, MAX_MICROFRAME_INTERVAL) - 1);
 	}
 
-	if(configured_interval == 0) {
-		printk(KERN_WARNING "ds_oc: Invalid interval parameter specified.\n");
-		configured_interval = 1;
+	return (u64)(NSEC_PER_SEC / FRAME_RATE_HZ) << (fls(clamp_t(unsigned short, interval, 1, 255)) - 1);
+}
+
+/* Returns the bInterval value whose rate is closest to rate_hz on the link speed of the device. */
+static unsigned short hz_to_interval(struct usb_device* device, unsigned int rate_hz) {
+	unsigned short max_interval = uses_microframes(device) ? MAX_MICROFRAME_INTERVAL : 8;
+	u64 period_ns = div_u64(NSEC_PER_SEC, max(rate_hz, 1U));
+	unsigned short best = 1;
+	u64 best_error = U64_MAX;
+
+	/*
+	 * Only the power of two steps are reachable, compare them by ratio so 3000 Hz picks 4000 Hz rather than 2000 Hz.
+	 * Periods are compared instead of rates, the slowest microframe intervals are below 1 Hz.
+	 */
+	for(unsigned short step = 1; step <= max_interval; step++) {
+		unsigned short interval = uses_microframes(device) ? step : 1 << (step - 1);
+		u64 step_ns = interval_to_period_ns(device, interval);
+		u64 error = step_ns > period_ns ? div64_u64(step_ns * 1000, period_ns) : div64_u64(period_ns * 1000, step_ns);
+
+		if(error < best_error) {
+			best_error = error;
+			best = interval;
+		}
 	}
 
-	usb_for_each_dev(NULL, &usb_device_cb);
-	usb_register_notify(&usb_nb);
+	return best;
+}
 
-	return 0;
+/*
+ * Returns the bInterval value the endpoint should be patched to, 0 means the original value is restored.
+ * device_hz is the rate set for this device alone in the format of rate_hz_override, it takes the place of rate/rate_hz.
+ */
+static unsigned short target_interval(struct usb_device* device, int dir, unsigned int device_hz) {
+	if(configured_dir_hz[dir] == RATE_ORIGINAL) {
+		return 0;
+	}
+
+	if(configured_dir_hz[dir] != 0) {
+		return hz_to_interval(device, configured_dir_hz[dir]);
+	}
+
+	if(device_hz == RATE_ORIGINAL) {
+		return 0;
+	}
+
+	if(device_hz != 0) {
+		return hz_to_interval(device, device_hz);
+	}
+
+	if(configured_rate_hz != 0) {
+		return hz_to_interval(device, configured_rate_hz);
+	}
+
+	/* Auto-tuning picks the input interval per device, nothing is measured for output endpoints. */
+	if(autotune) {
+		return 0;
+	}
+
+	return configured_interval;
 }
 
-static void __exit on_module_exit(void) {
-	if(adapter_device != NULL) {
-		patch_endpoints(restore_interval);
+/* Whether the rate of the direction is chosen by auto-tuning. */
+static bool is_autotuned(int dir) {
+	return autotune && configured_dir_hz[dir] == 0 && configured_rate_hz == 0;
+}
+
+/*
+ * Settings a controller takes along when it is unplugged and comes back, on any port if it has a serial number.
+ * good_interval is the last interval verified to deliver reports, tuned_interval the result of auto-tuning for tune_generation.
+ */
+struct policy_entry {
+	struct list_head list;
+	char key[POLICY_KEY_LEN];
+	/* bInterval values only mean the same rate at the same link speed, the intervals are ignored at another one. */
+	int speed;
+	unsigned int rate_hz_override;
+	unsigned short good_interval[ENDPOINT_DIRS];
+	bool tuned;
+	unsigned int tune_generation;
+	unsigned short tuned_interval;
+};
+
+/* Ordered from the least to the most recently seen controller. */
+static LIST_HEAD(policy_list);
+static unsigned int num_policies = 0;
+static DEFINE_MUTEX(policy_lock);
+
+/* Builds the key the policy of the device is stored under. Not every controller has a serial number, those are told apart by port. */
+static void policy_key(struct usb_device* device, char* key) {
+	u16 vid = le16_to_cpu(device->descriptor.idVendor);
+	u16 pid = le16_to_cpu(device->descriptor.idProduct);
+
+	if(device->serial != NULL && device->serial[0] != '\0') {
+		snprintf(key, POLICY_KEY_LEN, "%04x:%04x:%s", vid, pid, device->serial);
 	}
+	else {
+		snprintf(key, POLICY_KEY_LEN, "%04x:%04x@%s", vid, pid, dev_name(&device->dev));
+	}
+}
 
-	usb_unregister_notify(&usb_nb);
+/* Must be called with policy_lock held. */
+static struct policy_entry* find_policy(const char* key) {
+	struct policy_entry* entry;
+
+	list_for_each_entry(entry, &policy_list, list) {
+		if(strcmp(entry->key, key) == 0) {
+			return entry;
+		}
+	}
+
+	return NULL;
 }
 
-module_init(on_module_init);
-module_exit(on_module_exit);
+/* Copies the policy of the device to policy. Returns false if none is stored. */
+static bool lookup_policy(struct usb_device* device, struct policy_entry* policy) {
+	char key[POLICY_KEY_LEN];
+	struct policy_entry* entry;
 
-static int on_interval_changed(const char* value, const struct kernel_param* kp) {
-	int ret = param_set_ushort(value, kp);
+	policy_key(device, key);
 
-	if(!ret) {
-		if(configured_interval > 255) {
-			printk(KERN_WARNING "ds_oc: Invalid interval parameter specified.\n");
-			configured_interval = 255;
+	mutex_lock(&policy_lock);
+	entry = find_policy(key);
+	if(entry != NULL) {
+		*policy = *entry;
+	}
+	mutex_unlock(&policy_lock);
+
+	return entry != NULL;
+}
+
+static bool is_hid_interface(struct usb_interface* interface) {
+	for(unsigned int altsetting = 0; altsetting < interface->num_altsetting; altsetting++) {
+		if(interface->altsetting[altsetting].desc.bInterfaceClass == USB_CLASS_HID) {
+			return true;
 		}
-		else if(configured_interval == 0) {
-			printk(KERN_WARNING "ds_oc: Invalid interval parameter specified.\n");
-			configured_interval = 1;
+	}
+
+	return false;
+}
+
+/*
+ * Returns the direction the endpoint is patched in or -1 if it is left alone.
+ * Only interrupt endpoints qualify. The addresses from the match table are a hint: if the altsetting has an interrupt endpoint
+ * at the hinted address for a direction, only that one is patched, otherwise every interrupt endpoint of that direction is.
+ */
+static int endpoint_direction(const struct device_layout* layout, struct usb_host_interface* altsettingptr, struct usb_endpoint_descriptor* desc) {
+	int dir;
+	u8 hint;
+
+	if(!usb_endpoint_xfer_int(desc)) {
+		return -1;
+	}
+
+	dir = usb_endpoint_dir_in(desc) ? ENDPOINT_IN : ENDPOINT_OUT;
+	hint = dir == ENDPOINT_IN ? layout->ep_in : layout->ep_out;
+
+	if(desc->bEndpointAddress == hint) {
+		return dir;
+	}
+
+	for(__u8 endpoint = 0; endpoint < altsettingptr->desc.bNumEndpoints; endpoint++) {
+		struct usb_endpoint_descriptor* other = &altsettingptr->endpoint[endpoint].desc;
+
+		if(other->bEndpointAddress == hint && usb_endpoint_xfer_int(other)) {
+			return -1;
 		}
+	}
+
+	return dir;
+}
+
+/* Walks every altsetting of the interface, appending its applicable endpoints to the snapshot when snapshots is not NULL. Returns the number found. */
+static unsigned int snapshot_interface(struct ds_oc_device* dev, struct usb_interface* interface, struct endpoint_snapshot* snapshots) {
+	unsigned int count = 0;
+
+	for(unsigned int altsetting = 0; altsetting < interface->num_altsetting; altsetting++) {
+		struct usb_host_interface* altsettingptr = &interface->altsetting[altsetting];
+
+		for(__u8 endpoint = 0; endpoint < altsettingptr->desc.bNumEndpoints; endpoint++) {
+			struct usb_endpoint_descriptor* desc = &altsettingptr->endpoint[endpoint].desc;
+			int dir = endpoint_direction(&dev->layout, altsettingptr, desc);
+
+			if(dir < 0) {
+				continue;
+			}
 
-		patch_endpoints(configured_interval);
+			if(snapshots != NULL) {
+				struct endpoint_snapshot* snapshot = &snapshots[count];
+
+				snapshot->interface = interface;
+				snapshot->desc = desc;
+				snapshot->altsetting = altsetting;
+				snapshot->dir = dir;
+				snapshot->interval = desc->bInterval;
+			}
+			count++;
+		}
 	}
 
-	return ret;
+	return count;
 }
 
-static struct kernel_param_ops interval_ops = {
-	.set = &on_interval_changed,
-	.get = &param_get_ushort
+/* Original interval of an endpoint patched before the interface drivers bound. */
+struct early_endpoint {
+	struct usb_endpoint_descriptor* desc;
+	u8 interval;
 };
 
-module_param_cb(rate, &interval_ops, &configured_interval, 0644);
-MODULE_PARM_DESC(rate, "Polling rate (default: 1)");
+/* Kept from the early probe of a device until it is managed or disconnected. Holds a reference to the device. */
+struct early_patch {
+	struct list_head list;
+	struct usb_device* udev;
+	unsigned int count;
+	struct early_endpoint endpoints[];
+};
+
+static LIST_HEAD(early_list);
+static DEFINE_MUTEX(early_lock);
+
+/* Removes and returns the early patch of the device, NULL if it was not patched early. */
+static struct early_patch* take_early_patch(struct usb_device* device) {
+	struct early_patch* early;
+
+	mutex_lock(&early_lock);
+	list_for_each_entry(early, &early_list, list) {
+		if(early->udev == device) {
+			list_del(&early->list);
+			mutex_unlock(&early_lock);
+			return early;
+		}
+	}
+	mutex_unlock(&early_lock);
+
+	return NULL;
+}
+
+/* Writes the original intervals back unless keep is set and the endpoint is in the snapshot of dev, then frees the early patch. */
+static void release_early_patch(struct early_patch* early, struct ds_oc_device* dev, bool keep) {
+	for(unsigned int i = 0; i < early->count; i++) {
+		bool in_snapshot = false;
+
+		for(unsigned int j = 0; keep && j < dev->num_snapshots; j++) {
+			if(dev->snapshots[j].desc == early->endpoints[i].desc) {
+				in_snapshot = true;
+				break;
+			}
+		}
+
+		if(!in_snapshot) {
+			early->endpoints[i].desc->bInterval = early->endpoints[i].interval;
+		}
+	}
+
+	usb_put_dev(early->udev);
+	kfree(early);
+}
+
+/* Drops the early patch of a device that goes away or was never managed. */
+static void drop_early_patch(struct usb_device* device) {
+	struct early_patch* early = take_early_patch(device);
+
+	if(early != NULL) {
+		release_early_patch(early, NULL, false);
+	}
+}
+
+/*
+ * Walks the active configuration for HID interfaces and records their interrupt endpoints with their original intervals.
+ * If the interface from the match table is a HID interface only that one is used, otherwise every HID interface is.
+ * Called with dev->lock and the device lock held.
+ */
+static int take_snapshot(struct ds_oc_device* dev) {
+	struct usb_host_config* config = dev->udev->actconfig;
+	struct usb_interface* hinted = usb_ifnum_to_if(dev->udev, dev->layout.ifnum);
+	struct early_patch* early;
+	unsigned int count = 0;
+
+	if(hinted != NULL && !is_hid_interface(hinted)) {
+		hinted = NULL;
+	}
+
+	/* First pass counts, second pass fills. */
+	for(int pass = 0; pass < 2; pass++) {
+		for(unsigned int i = 0; i < config->desc.bNumInterfaces; i++) {
+			struct usb_interface* interface = config->interface[i];
+
+			if(interface == NULL || !is_hid_interface(interface) || (hinted != NULL && interface != hinted)) {
+				continue;
+			}
+
+			if(pass == 0) {
+				count += snapshot_interface(dev, interface, NULL);
+			}
+			else {
+				dev->num_snapshots += snapshot_interface(dev, interface, dev->snapshots + dev->num_snapshots);
+			}
+		}
+
+		if(pass == 0) {
+			if(count == 0) {
+				return -ENOENT;
+			}
+
+			dev->snapshots = kcalloc(count, sizeof(*dev->snapshots), GFP_KERNEL);
+			if(dev->snapshots == NULL) {
+				return -ENOMEM;
+			}
+		}
+	}
+
+	/* The descriptors of an early patched device already carry the new values, the originals were recorded by the early probe. */
+	early = take_early_patch(dev->udev);
+	if(early != NULL) {
+		for(unsigned int i = 0; i < dev->num_snapshots; i++) {
+			for(unsigned int j = 0; j < early->count; j++) {
+				if(early->endpoints[j].desc == dev->snapshots[i].desc) {
+					dev->snapshots[i].interval = early->endpoints[j].interval;
+					break;
+				}
+			}
+		}
+
+		release_early_patch(early, dev, true);
+		dev->apply_path = APPLY_PATH_EARLY;
+	}
+
+	return 0;
+}
+
+/* Raises the bus and translator times of the direction to the ones of a transaction on the endpoint, if those are larger. */
+static void add_transfer_time(struct usb_device* device, bool behind_tt, const struct usb_endpoint_descriptor* desc, int dir,
+	unsigned int* xfer_ns, unsigned int* tt_xfer_ns) {
+	bool is_input = dir == ENDPOINT_IN;
+	unsigned int maxp = usb_endpoint_maxp(desc);
+	/* Behind a transaction translator the bus only carries the high-speed split transactions. */
+	long ns = usb_calc_bus_time(behind_tt ? USB_SPEED_HIGH : device->speed, is_input, 0, maxp);
+
+	/* Negative for link speeds the calculation does not know, those devices are left out of planning. */
+	if(ns > 0 && ns > xfer_ns[dir]) {
+		xfer_ns[dir] = ns;
+	}
+
+	if(behind_tt) {
+		ns = usb_calc_bus_time(device->speed, is_input, 0, maxp);
+
+		if(ns > 0 && ns > tt_xfer_ns[dir]) {
+			tt_xfer_ns[dir] = ns;
+		}
+	}
+}
+
+/* Records the bus time of a transaction on the largest endpoint of each direction. Called with dev->lock held. */
+static void record_transfer_times(struct ds_oc_device* dev) {
+	for(unsigned int i = 0; i < dev->num_snapshots; i++) {
+		struct endpoint_snapshot* snapshot = &dev->snapshots[i];
+
+		add_transfer_time(dev->udev, dev->tt_hub != NULL, snapshot->desc, snapshot->dir, dev->xfer_ns, dev->tt_xfer_ns);
+	}
+}
+
+/* Writes the original intervals back to the descriptors without applying them. Called with dev->lock held. */
+static void restore_snapshot(struct ds_oc_device* dev) {
+	for(unsigned int i = 0; i < dev->num_snapshots; i++) {
+		dev->snapshots[i].desc->bInterval = dev->snapshots[i].interval;
+	}
+}
+
+/* Returns the original interval of the first endpoint of the direction, 0 if none was recorded yet. Called with dev->lock held. */
+static unsigned short original_interval(struct ds_oc_device* dev, int dir) {
+	for(unsigned int i = 0; i < dev->num_snapshots; i++) {
+		if(dev->snapshots[i].dir == dir) {
+			return dev->snapshots[i].interval;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * CPU latency request held while overclocked controllers are in use. Deep C-state exits on the CPU handling the host controller
+ * interrupt would otherwise add more latency than the faster polling saves. qos_lock serializes adding, updating and removing it.
+ */
+static struct pm_qos_request qos_request;
+static DEFINE_MUTEX(qos_lock);
+static bool qos_active = false;
+/* Completion time of the last report of any overclocked controller, written from the URB completion path. */
+static u64 qos_last_ns = 0;
+
+static void qos_work_fn(struct work_struct* work);
+static void qos_idle_work_fn(struct work_struct* work);
+
+static DECLARE_WORK(qos_work, &qos_work_fn);
+static DECLARE_DELAYED_WORK(qos_idle_work, &qos_idle_work_fn);
+
+/* Drops the request. Called with qos_lock held. */
+static void qos_release(void) {
+	if(qos_active) {
+		cpu_latency_qos_remove_request(&qos_request);
+		WRITE_ONCE(qos_active, false);
+		pr_debug("ds_oc: No overclocked controller is active, CPU latency request dropped.\n");
+	}
+}
+
+/* Adds or updates the request to the configured bound, queued from the URB completion path and when the bound changes. */
+static void qos_work_fn(struct work_struct* work) {
+	int latency = READ_ONCE(qos_latency_us);
+
+	mutex_lock(&qos_lock);
+	if(latency < 0) {
+		qos_release();
+	}
+	else if(qos_active) {
+		cpu_latency_qos_update_request(&qos_request, latency);
+	}
+	else if(qos_last_ns != 0 && ktime_get_ns() - READ_ONCE(qos_last_ns) < (u64)qos_idle_ms * NSEC_PER_MSEC) {
+		cpu_latency_qos_add_request(&qos_request, latency);
+		WRITE_ONCE(qos_active, true);
+		pr_debug("ds_oc: Overclocked controller active, holding a CPU latency request of %d us.\n", latency);
+
+		mod_delayed_work(apply_wq, &qos_idle_work, msecs_to_jiffies(qos_idle_ms));
+	}
+	mutex_unlock(&qos_lock);
+}
+
+/* Drops the request once the overclocked controllers went quiet, otherwise checks again when they could at the earliest. */
+static void qos_idle_work_fn(struct work_struct* work) {
+	u64 idle_ns = (u64)qos_idle_ms * NSEC_PER_MSEC;
+	u64 quiet_ns = ktime_get_ns() - READ_ONCE(qos_last_ns);
+
+	mutex_lock(&qos_lock);
+	if(qos_active) {
+		if(quiet_ns >= idle_ns) {
+			qos_release();
+		}
+		else {
+			mod_delayed_work(apply_wq, &qos_idle_work, nsecs_to_jiffies(idle_ns - quiet_ns) + 1);
+		}
+	}
+	mutex_unlock(&qos_lock);
+}
+
+static unsigned int hist_bucket(u32 us) {
+	unsigned int exponent;
+
+	if(us < HIST_LINEAR_BUCKETS) {
+		return us;
+	}
+
+	if(us >= HIST_MAX_US) {
+		return HIST_BUCKETS - 1;
+	}
+
+	exponent = fls(us) - 1;
+
+	return HIST_LINEAR_BUCKETS + (exponent - 4) * HIST_SUB_BUCKETS + ((us >> (exponent - 3)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* Returns the smallest value that falls into the bucket and stores the width of the bucket. */
+static u32 hist_bucket_start(unsigned int bucket, u32* width) {
+	unsigned int exponent;
+
+	if(bucket < HIST_LINEAR_BUCKETS) {
+		*width = 1;
+		return bucket;
+	}
+
+	exponent = (bucket - HIST_LINEAR_BUCKETS) / HIST_SUB_BUCKETS + 4;
+	*width = 1 << (exponent - 3);
+
+	return (HIST_SUB_BUCKETS + (bucket - HIST_LINEAR_BUCKETS) % HIST_SUB_BUCKETS) << (exponent - 3);
+}
+
+/* Appends a report to the ring. There is only one producer per ring, so this needs no locks. */
+static void push_report(struct report_ring* ring, const struct urb* urb, u64 now) {
+	struct ds_oc_ring_entry* entry = &ring->entries[ring->head & (DS_OC_RING_ENTRIES - 1)];
+	/* The buffer is not unmapped yet, but usbhid allocates it with usb_alloc_coherent() so it is already up to date. */
+	const u8* data = urb->transfer_buffer;
+
+	entry->timestamp_ns = now;
+	entry->length = min_t(u32, urb->actual_length, U16_MAX);
+	entry->report_id = data != NULL ? data[0] : 0;
+	entry->report_seq = data != NULL && urb->actual_length > DS_OC_RING_SEQ_OFFSET ? data[DS_OC_RING_SEQ_OFFSET] : 0;
+
+	/* Publish the entry before its index and the index before the new head. */
+	smp_wmb();
+	WRITE_ONCE(entry->index, (u32)ring->head);
+	ring->head++;
+	smp_wmb();
+	WRITE_ONCE(ring->header->head, ring->head);
+}
+
+/* Called from the URB completion path, must not sleep or take locks. */
+static void record_report(struct report_monitor* monitor, const struct urb* urb, u64 now) {
+	u64 last = READ_ONCE(monitor->last_ns);
+	struct report_stats* stats;
+	u32 delta_us;
+
+	const u8* data = urb->transfer_buffer;
+
+	if(monitor->ring != NULL) {
+		push_report(monitor->ring, urb, now);
+	}
+
+	/* A controller polled faster than it samples repeats its last report with the same sequence byte. */
+	if(data == NULL || urb->actual_length <= DS_OC_RING_SEQ_OFFSET || monitor->reports == 0 || data[DS_OC_RING_SEQ_OFFSET] != monitor->last_seq) {
+		WRITE_ONCE(monitor->unique_reports, monitor->unique_reports + 1);
+	}
+	if(data != NULL && urb->actual_length > DS_OC_RING_SEQ_OFFSET) {
+		monitor->last_seq = data[DS_OC_RING_SEQ_OFFSET];
+	}
+	WRITE_ONCE(monitor->reports, monitor->reports + 1);
+
+	if(trace_ds_oc_report_enabled()) {
+		bool has_seq = data != NULL && urb->actual_length > DS_OC_RING_SEQ_OFFSET;
+
+		trace_ds_oc_report(dev_name(&monitor->udev->dev), monitor->endpoint, urb->actual_length, data != NULL ? data[0] : 0,
+			has_seq ? data[DS_OC_RING_SEQ_OFFSET] : 0, last != 0 ? now - last : 0);
+	}
+
+	/* With the request disabled the shared timestamp is left alone, so reports of several controllers do not bounce its cache line. */
+	if(READ_ONCE(qos_latency_us) >= 0 && READ_ONCE(monitor->overclocked)) {
+		WRITE_ONCE(qos_last_ns, now);
+
+		if(!READ_ONCE(qos_active)) {
+			/* queue_work() is safe here and does nothing while the work is already pending. */
+			queue_work(apply_wq, &qos_work);
+		}
+	}
+
+	WRITE_ONCE(monitor->last_ns, now);
+	if(last == 0) {
+		WRITE_ONCE(monitor->first_ns, now);
+		return;
+	}
+
+	delta_us = min_t(u64, div_u64(now - last, NSEC_PER_USEC), U32_MAX);
+	stats = this_cpu_ptr(monitor->stats);
+
+	stats->count++;
+	stats->sum_us += delta_us;
+	if(delta_us < stats->min_us) {
+		stats->min_us = delta_us;
+	}
+	if(delta_us > stats->max_us) {
+		stats->max_us = delta_us;
+	}
+	stats->buckets[hist_bucket(delta_us)]++;
+}
+
+/* Must be called with monitor_table_lock or the RCU read lock held. */
+static struct report_monitor* find_monitor(struct usb_device* device) {
+	struct report_monitor* monitor;
+
+	hash_for_each_possible_rcu(monitor_table, monitor, node, (unsigned long)device) {
+		if(monitor->udev == device) {
+			return monitor;
+		}
+	}
+
+	return NULL;
+}
+
+/* Runs before usb_hcd_giveback_urb(hcd, urb, status) for every URB on the system, so bail out as early as possible. */
+static int on_urb_giveback(struct kprobe* probe, struct pt_regs* regs) {
+	struct urb* urb = (struct urb*)regs_get_kernel_argument(regs, 1);
+	int status = (int)regs_get_kernel_argument(regs, 2);
+	struct report_monitor* monitor;
+
+	if(status != 0 || !usb_pipeint(urb->pipe) || !usb_pipein(urb->pipe) || urb->actual_length == 0) {
+		return 0;
+	}
+
+	rcu_read_lock();
+	monitor = find_monitor(urb->dev);
+	if(monitor != NULL && usb_pipeendpoint(urb->pipe) == (monitor->endpoint & USB_ENDPOINT_NUMBER_MASK)) {
+		record_report(monitor, urb, ktime_get_ns());
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+
+static struct kprobe giveback_probe = {
+	.symbol_name = "usb_hcd_giveback_urb",
+	.pre_handler = &on_urb_giveback
+};
+
+static bool giveback_probe_registered = false;
+
+static void revalidate_work_fn(struct work_struct* work);
+
+/* Checks the devices somebody else reset, see on_reset_return. */
+static DECLARE_WORK(revalidate_work, &revalidate_work_fn);
+
+static int on_reset_entry(struct kretprobe_instance* instance, struct pt_regs* regs) {
+	*(struct usb_device**)instance->data = (struct usb_device*)regs_get_kernel_argument(regs, 0);
+
+	return 0;
+}
+
+/* Runs when usb_reset_device(udev) returns. A reset can re-enumerate the device, so its rate is checked afterwards. */
+static int on_reset_return(struct kretprobe_instance* instance, struct pt_regs* regs) {
+	struct usb_device* udev = *(struct usb_device**)instance->data;
+	struct report_monitor* monitor;
+
+	rcu_read_lock();
+	monitor = find_monitor(udev);
+	if(monitor != NULL && !READ_ONCE(monitor->self_reset)) {
+		WRITE_ONCE(monitor->reset_seen, true);
+		queue_work(apply_wq, &revalidate_work);
+	}
+	rcu_read_unlock();
+
+	return 0;
+}
+
+static struct kretprobe reset_probe = {
+	.kp.symbol_name = "usb_reset_device",
+	.entry_handler = &on_reset_entry,
+	.handler = &on_reset_return,
+	.data_size = sizeof(struct usb_device*),
+	.maxactive = 8
+};
+
+static bool reset_probe_registered = false;
+
+/* Sums up the statistics of all CPUs. */
+static void collect_stats(struct report_monitor* monitor, struct report_stats* total) {
+	int cpu;
+
+	memset(total, 0, sizeof(*total));
+	total->min_us = U32_MAX;
+
+	for_each_possible_cpu(cpu) {
+		struct report_stats* stats = per_cpu_ptr(monitor->stats, cpu);
+
+		total->count += stats->count;
+		total->sum_us += stats->sum_us;
+		total->min_us = min(total->min_us, stats->min_us);
+		total->max_us = max(total->max_us, stats->max_us);
+
+		for(unsigned int bucket = 0; bucket < HIST_BUCKETS; bucket++) {
+			total->buckets[bucket] += stats->buckets[bucket];
+		}
+	}
+}
+
+/* Returns the midpoint of the bucket holding the given percentile. */
+static u32 hist_percentile(const struct report_stats* total, unsigned int percentile) {
+	u64 target = div_u64(total->count * percentile + 99, 100);
+	u64 seen = 0;
+
+	for(unsigned int bucket = 0; bucket < HIST_BUCKETS; bucket++) {
+		seen += total->buckets[bucket];
+
+		if(seen >= target && seen > 0) {
+			u32 width;
+			u32 start = hist_bucket_start(bucket, &width);
+
+			return start + width / 2;
+		}
+	}
+
+	return 0;
+}
+
+static void reset_stats(struct report_monitor* monitor) {
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct report_stats* stats = per_cpu_ptr(monitor->stats, cpu);
+
+		memset(stats, 0, sizeof(*stats));
+		stats->min_us = U32_MAX;
+	}
+
+	WRITE_ONCE(monitor->last_ns, 0);
+}
+
+static int reports_show(struct seq_file* file, void* data) {
+	struct report_monitor* monitor = file->private;
+	struct report_stats* total = kmalloc(sizeof(*total), GFP_KERNEL);
+	u64 first_ns = READ_ONCE(monitor->first_ns);
+	u64 last_ns = READ_ONCE(monitor->last_ns);
+
+	if(total == NULL) {
+		return -ENOMEM;
+	}
+
+	collect_stats(monitor, total);
+
+	seq_printf(file, "endpoint: 0x%02x\n", monitor->endpoint);
+	seq_printf(file, "reports: %llu\n", total->count);
+
+	if(total->count > 0) {
+		seq_printf(file, "reports_per_sec: %llu\n", last_ns > first_ns ? div64_u64(total->count * NSEC_PER_SEC, last_ns - first_ns) : 0);
+		seq_printf(file, "min_us: %u\n", total->min_us);
+		seq_printf(file, "avg_us: %llu\n", div64_u64(total->sum_us, total->count));
+		seq_printf(file, "p50_us: %u\n", hist_percentile(total, 50));
+		seq_printf(file, "p99_us: %u\n", hist_percentile(total, 99));
+		seq_printf(file, "max_us: %u\n", total->max_us);
+		seq_puts(file, "histogram:\n");
+
+		for(unsigned int bucket = 0; bucket < HIST_BUCKETS; bucket++) {
+			if(total->buckets[bucket] != 0) {
+				u32 width;
+				u32 start = hist_bucket_start(bucket, &width);
+
+				seq_printf(file, "%u-%u %u\n", start, start + width - 1, total->buckets[bucket]);
+			}
+		}
+	}
+
+	kfree(total);
+
+	return 0;
+}
+
+static int reports_open(struct inode* inode, struct file* file) {
+	return single_open(file, &reports_show, inode->i_private);
+}
+
+/* Any write clears the statistics. */
+static ssize_t reports_write(struct file* file, const char __user* buffer, size_t count, loff_t* pos) {
+	struct seq_file* seq = file->private_data;
+
+	reset_stats(seq->private);
+
+	return count;
+}
+
+static const struct file_operations reports_fops = {
+	.owner = THIS_MODULE,
+	.open = &reports_open,
+	.read = &seq_read,
+	.write = &reports_write,
+	.llseek = &seq_lseek,
+	.release = &single_release
+};
+
+static void release_ring(struct kref* kref) {
+	struct report_ring* ring = container_of(kref, struct report_ring, kref);
+
+	vfree(ring->header);
+	kfree(ring);
+}
+
+static int ring_open(struct inode* inode, struct file* file) {
+	struct report_ring* ring = container_of(file->private_data, struct report_ring, misc);
+
+	/* The ring is written by the kernel only. */
+	if(file->f_mode & FMODE_WRITE) {
+		return -EPERM;
+	}
+
+	/* misc_open holds the misc lock, so the device cannot be deregistered and the ring freed before we take our reference. */
+	kref_get(&ring->kref);
+	file->private_data = ring;
+
+	return 0;
+}
+
+static int ring_release(struct inode* inode, struct file* file) {
+	struct report_ring* ring = file->private_data;
+
+	kref_put(&ring->kref, &release_ring);
+
+	return 0;
+}
+
+static int ring_mmap(struct file* file, struct vm_area_struct* vma) {
+	struct report_ring* ring = file->private_data;
+
+	if(vma->vm_flags & VM_WRITE) {
+		return -EPERM;
+	}
+
+	return remap_vmalloc_range(vma, ring->header, vma->vm_pgoff);
+}
+
+static const struct file_operations ring_fops = {
+	.owner = THIS_MODULE,
+	.open = &ring_open,
+	.release = &ring_release,
+	.mmap = &ring_mmap
+};
+
+/* Creates the ring and its character device /dev/ds_oc/<device>. Returns NULL if either fails, the statistics work without it. */
+static struct report_ring* create_ring(struct usb_device* device) {
+	struct report_ring* ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	size_t data_offset = PAGE_ALIGN(sizeof(struct ds_oc_ring_header));
+
+	if(ring == NULL) {
+		return NULL;
+	}
+
+	kref_init(&ring->kref);
+	ring->size = PAGE_ALIGN(data_offset + DS_OC_RING_ENTRIES * sizeof(struct ds_oc_ring_entry));
+	ring->header = vmalloc_user(ring->size);
+	if(ring->header == NULL) {
+		kfree(ring);
+		return NULL;
+	}
+
+	ring->header->version = DS_OC_RING_VERSION;
+	ring->header->entry_size = sizeof(struct ds_oc_ring_entry);
+	ring->header->num_entries = DS_OC_RING_ENTRIES;
+	ring->header->data_offset = data_offset;
+	ring->entries = (struct ds_oc_ring_entry*)((u8*)ring->header + data_offset);
+
+	snprintf(ring->name, sizeof(ring->name), "ds_oc-%s", dev_name(&device->dev));
+	snprintf(ring->nodename, sizeof(ring->nodename), "ds_oc/%s", dev_name(&device->dev));
+	ring->misc.minor = MISC_DYNAMIC_MINOR;
+	ring->misc.name = ring->name;
+	ring->misc.nodename = ring->nodename;
+	ring->misc.mode = 0400;
+	ring->misc.fops = &ring_fops;
+
+	if(misc_register(&ring->misc)) {
+		printk(KERN_WARNING "ds_oc: Could not register report ring device for %s.\n", dev_name(&device->dev));
+		kref_put(&ring->kref, &release_ring);
+		return NULL;
+	}
+
+	return ring;
+}
+
+/* Starts collecting report statistics for the first patched input endpoint of the device. Called with dev->lock held. */
+static void start_monitor(struct ds_oc_device* dev) {
+	struct report_monitor* monitor;
+	unsigned int i;
+
+	for(i = 0; i < dev->num_snapshots; i++) {
+		if(dev->snapshots[i].dir == ENDPOINT_IN) {
+			break;
+		}
+	}
+
+	if(i == dev->num_snapshots || dev->monitor != NULL) {
+		return;
+	}
+
+	monitor = kzalloc(sizeof(*monitor), GFP_KERNEL);
+	if(monitor == NULL) {
+		return;
+	}
+
+	monitor->stats = alloc_percpu(struct report_stats);
+	if(monitor->stats == NULL) {
+		kfree(monitor);
+		return;
+	}
+
+	monitor->udev = dev->udev;
+	monitor->endpoint = dev->snapshots[i].desc->bEndpointAddress;
+	monitor->ring = create_ring(dev->udev);
+	reset_stats(monitor);
+
+	if(debugfs_root != NULL) {
+		monitor->debugfs_dir = debugfs_create_dir(dev_name(&dev->udev->dev), debugfs_root);
+		debugfs_create_file("reports", 0600, monitor->debugfs_dir, monitor, &reports_fops);
+	}
+
+	mutex_lock(&monitor_table_lock);
+	hash_add_rcu(monitor_table, &monitor->node, (unsigned long)monitor->udev);
+	mutex_unlock(&monitor_table_lock);
+
+	dev->monitor = monitor;
+}
+
+/* Returns the number of reports seen so far, unaffected by clearing the statistics. */
+static u64 monitor_reports(struct report_monitor* monitor) {
+	return READ_ONCE(monitor->reports);
+}
+
+/* Whether the monitored endpoint delivered a report within the last second. */
+static bool monitor_active(struct report_monitor* monitor) {
+	u64 last_ns = READ_ONCE(monitor->last_ns);
+
+	return last_ns != 0 && ktime_get_ns() - last_ns < NSEC_PER_SEC;
+}
+
+/* Starts measuring the report rate after a patch was applied. Called with dev->lock held. */
+static void start_verify(struct ds_oc_device* dev, bool active) {
+	/* Auto-tuning measures every candidate itself and must not be interrupted by a fallback. */
+	if(verify_ms == 0 || dev->monitor == NULL || dev->restoring || dev->tune_state == TUNE_RUNNING) {
+		dev->verify_result = VERIFY_NONE;
+		return;
+	}
+
+	dev->verify_result = VERIFY_PENDING;
+	dev->verify_reports = monitor_reports(dev->monitor);
+	dev->verify_start_ns = ktime_get_ns();
+	dev->verify_active = active;
+
+	kref_get(&dev->kref);
+	if(mod_delayed_work(apply_wq, &dev->verify_work, msecs_to_jiffies(verify_ms))) {
+		put_device_state(dev);
+	}
+}
+
+static void free_monitor(struct rcu_head* rcu) {
+	struct report_monitor* monitor = container_of(rcu, struct report_monitor, rcu);
+
+	if(monitor->ring != NULL) {
+		kref_put(&monitor->ring->kref, &release_ring);
+	}
+
+	free_percpu(monitor->stats);
+	kfree(monitor);
+}
+
+/* Called with dev->lock held. */
+static void stop_monitor(struct ds_oc_device* dev) {
+	struct report_monitor* monitor = dev->monitor;
+
+	if(monitor == NULL) {
+		return;
+	}
+
+	/* Waits for readers of the debugfs file, the kprobe may still see the monitor until the grace period ends. */
+	debugfs_remove_recursive(monitor->debugfs_dir);
+
+	/* Open files keep the ring alive until they are closed. */
+	if(monitor->ring != NULL) {
+		misc_deregister(&monitor->ring->misc);
+	}
+
+	mutex_lock(&monitor_table_lock);
+	hash_del_rcu(&monitor->node);
+	mutex_unlock(&monitor_table_lock);
+
+	call_rcu(&monitor->rcu, &free_monitor);
+	dev->monitor = NULL;
+}
+
+/*
+ * Patches all applicable endpoints of the device and applies the new values.
+ * intervals is indexed by enum endpoint_dir, a value of 0 restores the original interval of every endpoint of that direction.
+ * Nothing is applied when the descriptors already carry the requested values, unless the last attempt to apply them failed.
+ */
+static void patch_endpoints(struct ds_oc_device* dev, const unsigned short* intervals) {
+	struct usb_device* device = dev->udev;
+	ktime_t start = ktime_get();
+	bool changed = false;
+	bool active;
+
+	mutex_lock(&dev->lock);
+	if(dev->removed) {
+		mutex_unlock(&dev->lock);
+		return;
+	}
+
+	active = dev->monitor != NULL && monitor_active(dev->monitor);
+
+	/*
+	 * Attempt to lock the device.
+	 * This is required by the kernel documentation but it seems that some systems won't let you lock the USB device.
+	 * Older versions before 1.2 never called this function and still worked so we proceed even if locking fails.
+	 */
+	int lock_ret = usb_lock_device_for_reset(device, NULL);
+	if(lock_ret == -ENODEV) {
+		/* The device is already gone, there is nothing left to patch. */
+		mutex_unlock(&dev->lock);
+		return;
+	}
+	if(lock_ret) {
+		printk(KERN_ERR "ds_oc: Warning! Failed to acquire lock for USB device %s (error: %d). Only a reset can apply new values...\n", dev_name(&device->dev), lock_ret);
+	}
+
+	if(device->actconfig != NULL && dev->snapshots == NULL && dev->status != DEVICE_STATUS_UNSUPPORTED) {
+		int ret = take_snapshot(dev);
+
+		if(ret == -ENOENT) {
+			printk(KERN_WARNING "ds_oc: No HID interrupt endpoints found on %s, leaving it untouched.\n", dev_name(&device->dev));
+			dev->status = DEVICE_STATUS_UNSUPPORTED;
+		}
+		else if(ret) {
+			printk(KERN_ERR "ds_oc: Could not record the original intervals of %s, leaving it untouched.\n", dev_name(&device->dev));
+		}
+		else {
+			record_transfer_times(dev);
+			start_monitor(dev);
+		}
+	}
+
+	if(dev->snapshots != NULL) {
+		bool revalidate = dev->revalidate;
+
+		dev->revalidate = false;
+
+		for(unsigned int i = 0; i < dev->num_snapshots; i++) {
+			struct endpoint_snapshot* snapshot = &dev->snapshots[i];
+			unsigned short interval = intervals[snapshot->dir] != 0 ? intervals[snapshot->dir] : snapshot->interval;
+
+			if(snapshot->desc->bInterval != interval) {
+				trace_ds_oc_patch(dev_name(&device->dev), snapshot->desc->bEndpointAddress, snapshot->interface->altsetting[0].desc.bInterfaceNumber,
+					snapshot->altsetting, snapshot->desc->bInterval, interval, false);
+
+				snapshot->desc->bInterval = interval;
+				changed = true;
+
+				pr_debug("ds_oc: bInterval value of endpoint 0x%.2x (interface %u, altsetting %u) on %s set to %u.\n", snapshot->desc->bEndpointAddress,
+					snapshot->interface->altsetting[0].desc.bInterfaceNumber, snapshot->altsetting, dev_name(&device->dev), interval);
+			}
+
+			dev->interval[snapshot->dir] = interval;
+			dev->rate_hz[snapshot->dir] = interval_to_hz(device, interval);
+		}
+
+		/* The host controller already uses the descriptor values unless they changed or the last attempt to apply them failed. */
+		if(changed || dev->status == DEVICE_STATUS_FAILED || dev->force_apply) {
+			dev->force_apply = false;
+			dev->verify_revalidate = false;
+			dev->apply_path = apply_endpoints(dev, lock_ret);
+			dev->apply_us = ktime_us_delta(ktime_get(), start);
+			dev->status = dev->apply_path != APPLY_PATH_NONE ? DEVICE_STATUS_PATCHED : DEVICE_STATUS_FAILED;
+
+			if(dev->apply_path == APPLY_PATH_DESCRIPTOR) {
+				printk_ratelimited(KERN_INFO "ds_oc: New bInterval value on %s takes effect when its interface driver binds again (host controller: %s).\n", dev_name(&device->dev), dev->hcd_name);
+			}
+			else if(dev->apply_path != APPLY_PATH_NONE) {
+				pr_debug("ds_oc: New bInterval value applied to %s by %s in %u us.\n", dev_name(&device->dev), apply_path_names[dev->apply_path], dev->apply_us);
+				start_verify(dev, active);
+			}
+		}
+		else {
+			dev->status = DEVICE_STATUS_PATCHED;
+
+			/* The descriptors survived, measure whether the host controller still polls at their rate. */
+			if(revalidate) {
+				start_verify(dev, active);
+				dev->verify_revalidate = dev->verify_result == VERIFY_PENDING;
+			}
+		}
+	}
+
+	if(dev->monitor != NULL) {
+		bool overclocked = false;
+
+		for(unsigned int i = 0; i < dev->num_snapshots; i++) {
+			if(dev->snapshots[i].desc->bInterval < dev->snapshots[i].interval) {
+				overclocked = true;
+			}
+		}
+
+		WRITE_ONCE(dev->monitor->overclocked, overclocked && dev->status == DEVICE_STATUS_PATCHED);
+	}
+
+	/* Only unlock the device if usb_lock_device_for_reset succeeded. */
+	if(!lock_ret) {
+		usb_unlock_device(device);
+	}
+
+	mutex_unlock(&dev->lock);
+}
+
+static u32 match_key(u16 vid, u16 pid) {
+	return ((u32)vid << 16) | pid;
+}
+
+/* Must be called with match_table_lock or the RCU read lock held. */
+static struct match_entry* find_match(u16 vid, u16 pid) {
+	struct match_entry* entry;
+
+	hash_for_each_possible_rcu(match_table, entry, node, match_key(vid, pid)) {
+		if(entry->vid == vid && entry->pid == pid) {
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+/* Looks the device up in the match table and copies the layout of its entry. */
+static bool is_overclockable(struct usb_device* device, struct device_layout* layout) {
+	struct match_entry* entry;
+
+	rcu_read_lock();
+	entry = find_match(le16_to_cpu(device->descriptor.idVendor), le16_to_cpu(device->descriptor.idProduct));
+	if(entry != NULL) {
+		*layout = entry->layout;
+	}
+	rcu_read_unlock();
+
+	return entry != NULL;
+}
+
+/* Adds an entry to the match table, replacing any existing entry for the same device unless keep_existing is set. */
+static int add_match(u16 vid, u16 pid, const struct device_layout* layout, bool keep_existing) {
+	struct match_entry* entry;
+	struct match_entry* old;
+
+	mutex_lock(&match_table_lock);
+	old = find_match(vid, pid);
+	if(old != NULL && keep_existing) {
+		mutex_unlock(&match_table_lock);
+		return 0;
+	}
+
+	entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+	if(entry == NULL) {
+		mutex_unlock(&match_table_lock);
+		return -ENOMEM;
+	}
+
+	entry->vid = vid;
+	entry->pid = pid;
+	entry->layout = *layout;
+
+	if(old != NULL) {
+		hash_del_rcu(&old->node);
+		kfree_rcu(old, rcu);
+	}
+	hash_add_rcu(match_table, &entry->node, match_key(vid, pid));
+	mutex_unlock(&match_table_lock);
+
+	return 0;
+}
+
+static int remove_match(u16 vid, u16 pid) {
+	struct match_entry* entry;
+
+	mutex_lock(&match_table_lock);
+	entry = find_match(vid, pid);
+	if(entry != NULL) {
+		hash_del_rcu(&entry->node);
+		kfree_rcu(entry, rcu);
+	}
+	mutex_unlock(&match_table_lock);
+
+	return entry != NULL ? 0 : -ENOENT;
+}
+
+static void queue_update(struct ds_oc_device* dev, unsigned long delay);
+
+/*
+ * Compares the report rate measured since the last patch with the requested one.
+ * If the device stopped delivering reports altogether it is patched back to the last intervals that worked.
+ */
+static void verify_work_fn(struct work_struct* work) {
+	struct ds_oc_device* dev = container_of(to_delayed_work(work), struct ds_oc_device, verify_work);
+	unsigned short fallback[ENDPOINT_DIRS];
+	bool fall_back = false;
+	bool reapply = false;
+
+	mutex_lock(&dev->lock);
+	if(!dev->removed && !dev->restoring && dev->monitor != NULL && dev->verify_result == VERIFY_PENDING) {
+		u64 reports = monitor_reports(dev->monitor) - dev->verify_reports;
+		u64 elapsed_ns = max_t(u64, ktime_get_ns() - dev->verify_start_ns, 1);
+		unsigned int requested_hz = dev->rate_hz[ENDPOINT_IN];
+
+		dev->achieved_hz = div64_u64(reports * NSEC_PER_SEC, elapsed_ns);
+
+		if(reports == 0) {
+			/* A device nobody reads from does not deliver reports at any rate, that says nothing about the patch. */
+			dev->verify_result = dev->verify_active ? VERIFY_FAILED : VERIFY_IDLE;
+		}
+		else if((u64)dev->achieved_hz * 100 >= (u64)requested_hz * VERIFY_ACHIEVED_PERCENT) {
+			dev->verify_result = VERIFY_ACHIEVED;
+		}
+		else {
+			dev->verify_result = VERIFY_DEGRADED;
+		}
+
+		if(dev->verify_result == VERIFY_ACHIEVED || dev->verify_result == VERIFY_DEGRADED) {
+			memcpy(dev->good_interval, dev->interval, sizeof(dev->good_interval));
+			dev->in_fallback = false;
+		}
+		else if(dev->verify_result == VERIFY_FAILED && !dev->in_fallback) {
+			memcpy(fallback, dev->good_interval, sizeof(fallback));
+			dev->in_fallback = true;
+			fall_back = true;
+
+			/* Updates for resumes, re-plans or demand switches must not bring the failing rate back. */
+			if(memcmp(dev->requested, dev->configured, sizeof(dev->requested)) == 0) {
+				memcpy(dev->failed_interval, dev->configured, sizeof(dev->failed_interval));
+				dev->has_failed = true;
+			}
+			memcpy(dev->requested, fallback, sizeof(dev->requested));
+			memcpy(dev->planned, fallback, sizeof(dev->planned));
+		}
+
+		/* After a resume the host controller may have rebuilt its schedule from stale state, apply the rate once more. */
+		if(dev->verify_revalidate && dev->verify_result == VERIFY_DEGRADED) {
+			dev->force_apply = true;
+			dev->reapplied++;
+			reapply = true;
+		}
+		dev->verify_revalidate = false;
+
+		trace_ds_oc_verify(dev_name(&dev->udev->dev), requested_hz, dev->achieved_hz, verify_result_names[dev->verify_result]);
+		pr_debug("ds_oc: Controller %s delivers %u reports per second at a requested %u Hz (%s).\n", dev_name(&dev->udev->dev), dev->achieved_hz, requested_hz, verify_result_names[dev->verify_result]);
+	}
+	mutex_unlock(&dev->lock);
+
+	if(fall_back) {
+		printk(KERN_WARNING "ds_oc: Controller %s stopped delivering reports, falling back to the last working interval.\n", dev_name(&dev->udev->dev));
+		patch_endpoints(dev, fallback);
+	}
+
+	if(reapply) {
+		printk(KERN_WARNING "ds_oc: Controller %s does not reach its rate after resume, reapplying it.\n", dev_name(&dev->udev->dev));
+		queue_update(dev, 0);
+	}
+
+	put_device_state(dev);
+}
+
+/* Fills tune_curve with the input intervals from the original one to the fastest one. Called with dev->lock held. */
+static void build_tune_curve(struct ds_oc_device* dev) {
+	bool microframes = uses_microframes(dev->udev);
+	unsigned short interval = original_interval(dev, ENDPOINT_IN);
+
+	dev->tune_steps = 0;
+	if(interval == 0) {
+		return;
+	}
+
+	/* Full-speed periods are rounded down to a power of two, only those steps change the rate. */
+	interval = microframes ? min_t(unsigned short, interval, MAX_MICROFRAME_INTERVAL) : rounddown_pow_of_two(interval);
+
+	while(dev->tune_steps < TUNE_MAX_STEPS) {
+		struct tune_point* point = &dev->tune_curve[dev->tune_steps++];
+
+		point->interval = interval;
+		point->hz = interval_to_hz(dev->udev, interval);
+		point->reports_hz = 0;
+		point->unique_hz = 0;
+
+		if(interval == 1) {
+			break;
+		}
+
+		interval = microframes ? interval - 1 : interval / 2;
+	}
+}
+
+/* Returns the fastest interval that delivered noticeably more unique reports than every slower one. Called with dev->lock held. */
+static unsigned short pick_tuned_interval(struct ds_oc_device* dev) {
+	unsigned int best = 0;
+
+	for(unsigned int i = 1; i < dev->tune_steps; i++) {
+		if((u64)dev->tune_curve[i].unique_hz * 100 > (u64)dev->tune_curve[best].unique_hz * (100 + TUNE_GAIN_PERCENT)) {
+			best = i;
+		}
+	}
+
+	return dev->tune_curve[best].interval;
+}
+
+/* Starts measuring the candidate intervals of the device from scratch. Called with dev->lock held. */
+static void start_tune(struct ds_oc_device* dev) {
+	dev->tune_state = TUNE_RUNNING;
+	dev->tune_phase = TUNE_PHASE_APPLY;
+	dev->tune_generation = tune_generation;
+	dev->tune_step = 0;
+	dev->tune_steps = 0;
+	dev->tuned_interval = 0;
+
+	kref_get(&dev->kref);
+	if(mod_delayed_work(apply_wq, &dev->tune_work, 0)) {
+		put_device_state(dev);
+	}
+}
+
+/*
+ * Runs one phase of auto-tuning: patch a candidate, let it settle, count reports, repeat with the next faster candidate.
+ * Once all candidates are measured, or the controller turns out idle, the device is patched to the chosen interval.
+ */
+static void tune_work_fn(struct work_struct* work) {
+	struct ds_oc_device* dev = container_of(to_delayed_work(work), struct ds_oc_device, tune_work);
+	unsigned short intervals[ENDPOINT_DIRS] = { 0, target_interval(dev->udev, ENDPOINT_OUT, 0) };
+	unsigned long delay = 0;
+	unsigned int generation;
+	unsigned int resets;
+	bool finished = false;
+
+	mutex_lock(&dev->lock);
+	if(dev->removed || dev->restoring || dev->tune_state != TUNE_RUNNING || !is_autotuned(ENDPOINT_IN) || dev->rate_hz_override != 0) {
+		/* Another rate was configured meanwhile, the update queued for it takes over. */
+		if(dev->tune_state == TUNE_RUNNING) {
+			dev->tune_state = TUNE_NONE;
+		}
+		mutex_unlock(&dev->lock);
+		put_device_state(dev);
+		return;
+	}
+
+	generation = dev->tune_generation;
+
+	switch(dev->tune_phase) {
+		case TUNE_PHASE_APPLY:
+			/*
+			 * Only a re-select changes the rate while the controller stays connected. Descriptors alone change nothing,
+			 * and a rebind or reset at every step would take the controller from the reader that is measured.
+			 */
+			if(device_apply_mode(dev) != APPLY_MODE_RESELECT) {
+				dev->tune_state = TUNE_FAILED;
+				finished = true;
+				break;
+			}
+
+			/* The first candidate is the original interval, patching to it also takes the snapshot the curve is built from. */
+			if(dev->tune_steps != 0) {
+				intervals[ENDPOINT_IN] = dev->tune_curve[dev->tune_step].interval;
+			}
+			resets = dev->resets;
+			mutex_unlock(&dev->lock);
+
+			patch_endpoints(dev, intervals);
+
+			mutex_lock(&dev->lock);
+			if(dev->tune_state != TUNE_RUNNING || dev->tune_generation != generation || !is_autotuned(ENDPOINT_IN)) {
+				/* Restarted or cancelled while the lock was dropped. */
+				if(dev->tune_generation == generation && dev->tune_state == TUNE_RUNNING) {
+					dev->tune_state = TUNE_NONE;
+				}
+				mutex_unlock(&dev->lock);
+				put_device_state(dev);
+				return;
+			}
+
+			if(dev->tune_steps == 0) {
+				build_tune_curve(dev);
+			}
+
+			/* A re-select that fell back to a reset would do so again at every step, measuring a controller that keeps reconnecting. */
+			if(dev->status != DEVICE_STATUS_PATCHED || dev->monitor == NULL || dev->tune_steps == 0 || dev->resets != resets) {
+				dev->tune_state = TUNE_FAILED;
+				finished = true;
+				break;
+			}
+
+			dev->tune_phase = TUNE_PHASE_START;
+			delay = msecs_to_jiffies(TUNE_SETTLE_MS);
+			break;
+
+		case TUNE_PHASE_START:
+			if(dev->monitor == NULL) {
+				dev->tune_state = TUNE_FAILED;
+				finished = true;
+				break;
+			}
+
+			dev->tune_reports = monitor_reports(dev->monitor);
+			dev->tune_unique = READ_ONCE(dev->monitor->unique_reports);
+			dev->tune_start_ns = ktime_get_ns();
+			dev->tune_phase = TUNE_PHASE_MEASURE;
+			delay = msecs_to_jiffies(max(autotune_ms, 1U));
+			break;
+
+		case TUNE_PHASE_MEASURE: {
+			struct tune_point* point = &dev->tune_curve[dev->tune_step];
+			u64 elapsed_ns = max_t(u64, ktime_get_ns() - dev->tune_start_ns, 1);
+			u64 reports;
+
+			if(dev->monitor == NULL) {
+				dev->tune_state = TUNE_FAILED;
+				finished = true;
+				break;
+			}
+
+			reports = monitor_reports(dev->monitor) - dev->tune_reports;
+			point->reports_hz = div64_u64(reports * NSEC_PER_SEC, elapsed_ns);
+			point->unique_hz = div64_u64((READ_ONCE(dev->monitor->unique_reports) - dev->tune_unique) * NSEC_PER_SEC, elapsed_ns);
+
+			pr_debug("ds_oc: Controller %s delivers %u reports per second (%u unique) at bInterval %u (%u Hz).\n", dev_name(&dev->udev->dev),
+				point->reports_hz, point->unique_hz, point->interval, point->hz);
+
+			/* Nothing to compare without reports, usually because nobody has the controller open. */
+			if(reports == 0) {
+				dev->tune_state = TUNE_IDLE;
+				finished = true;
+				break;
+			}
+
+			if(++dev->tune_step == dev->tune_steps) {
+				dev->tuned_interval = pick_tuned_interval(dev);
+				dev->tune_state = TUNE_DONE;
+				finished = true;
+
+				printk(KERN_INFO "ds_oc: Auto-tuning chose bInterval %u (%u Hz) for %s.\n", dev->tuned_interval, interval_to_hz(dev->udev, dev->tuned_interval),
+					dev_name(&dev->udev->dev));
+				break;
+			}
+
+			dev->tune_phase = TUNE_PHASE_APPLY;
+			break;
+		}
+	}
+	mutex_unlock(&dev->lock);
+
+	if(finished) {
+		/* Patches the device to the chosen interval, or back to the original one if tuning did not finish. */
+		queue_update(dev, 0);
+	}
+	else if(queue_delayed_work(apply_wq, &dev->tune_work, delay)) {
+		/* The queued work inherits our reference. */
+		return;
+	}
+
+	put_device_state(dev);
+}
+
+/* Bus time in ns per second the periodic transfers of the managed controllers may take on the bus. */
+static u64 bus_budget(struct usb_bus* bus) {
+	unsigned int limit = bus->root_hub->speed >= USB_SPEED_HIGH ? PERIODIC_LIMIT_HIGH_SPEED : PERIODIC_LIMIT_FULL_SPEED;
+
+	return div_u64((u64)NSEC_PER_SEC * limit * bandwidth_pct, 100 * 100);
+}
+
+/* Full-speed time in ns per second the periodic transfers of the managed controllers may take on one transaction translator. */
+static u64 tt_budget(void) {
+	return div_u64((u64)NSEC_PER_SEC * PERIODIC_LIMIT_FULL_SPEED * bandwidth_pct, 100 * 100);
+}
+
+/*
+ * Returns the time in ns per second the device takes up at the intervals, with xfer_ns being either its bus or its translator times.
+ * 0 means the original interval. Called with dev->lock held.
+ */
+static u64 device_cost(struct ds_oc_device* dev, const unsigned short* intervals, const unsigned int* xfer_ns) {
+	u64 cost = 0;
+
+	for(int dir = 0; dir < ENDPOINT_DIRS; dir++) {
+		unsigned short interval = intervals[dir] != 0 ? intervals[dir] : original_interval(dev, dir);
+
+		cost += (u64)xfer_ns[dir] * interval_to_hz(dev->udev, interval);
+	}
+
+	return cost;
+}
+
+/* One device of a bus being planned. Intervals are resolved, 0 only remains for endpoints that were never seen. */
+struct plan_entry {
+	struct ds_oc_device* dev;
+	unsigned short interval[ENDPOINT_DIRS];
+	unsigned short original[ENDPOINT_DIRS];
+	unsigned int xfer_ns[ENDPOINT_DIRS];
+	unsigned int tt_xfer_ns[ENDPOINT_DIRS];
+	/* Whether the translator of the device is over its budget with the current intervals. */
+	bool tt_over;
+};
+
+static u64 entry_cost(const struct plan_entry* entry, const unsigned int* xfer_ns) {
+	u64 cost = 0;
+
+	for(int dir = 0; dir < ENDPOINT_DIRS; dir++) {
+		cost += (u64)xfer_ns[dir] * interval_to_hz(entry->dev->udev, entry->interval[dir]);
+	}
+
+	return cost;
+}
+
+static bool same_tt(const struct ds_oc_device* a, const struct ds_oc_device* b) {
+	return a->tt_hub != NULL && a->tt_hub == b->tt_hub && a->tt_port == b->tt_port;
+}
+
+/* Returns the next slower interval, never slower than the original one. */
+static unsigned short slower_interval(struct usb_device* device, unsigned short interval, unsigned short original) {
+	unsigned short next = uses_microframes(device) ? interval + 1 : interval * 2;
+
+	return interval_to_hz(device, next) <= interval_to_hz(device, original) ? original : next;
+}
+
+/*
+ * Grants the requested intervals to every managed device on the bus of dev if they fit into the bus budget and the budgets of the
+ * transaction translators on it. Otherwise the fastest endpoint that takes part in an exceeded budget is slowed down one step at a time
+ * until everything fits, so each budget is split as evenly as the reachable rates allow and nobody is slowed below its original rate.
+ * Devices behind the same translator therefore cannot starve each other, nor full-speed devices the rest of the bus. The intervals granted to dev are stored in intervals, devices
+ * whose grant changed are queued for an update. Called without any locks held.
+ */
+static void plan_bus(struct ds_oc_device* dev, unsigned short* intervals) {
+	struct usb_bus* bus = dev->udev->bus;
+	struct ds_oc_device* other;
+	struct plan_entry* entries;
+	unsigned int count = 0;
+	unsigned int n = 0;
+	u64 budget = bus_budget(bus);
+
+	mutex_lock(&device_list_lock);
+	list_for_each_entry(other, &device_list, list) {
+		if(other->udev->bus == bus) {
+			count++;
+		}
+	}
+
+	entries = count != 0 ? kcalloc(count, sizeof(*entries), GFP_KERNEL) : NULL;
+	if(entries == NULL || bandwidth_pct == 0) {
+		/* Without a plan every device gets what it asked for. */
+		mutex_unlock(&device_list_lock);
+		kfree(entries);
+
+		mutex_lock(&dev->lock);
+		memcpy(dev->planned, dev->requested, sizeof(dev->planned));
+		memcpy(intervals, dev->planned, sizeof(dev->planned));
+		mutex_unlock(&dev->lock);
+		return;
+	}
+
+	list_for_each_entry(other, &device_list, list) {
+		struct plan_entry* entry;
+
+		if(other->udev->bus != bus) {
+			continue;
+		}
+
+		entry = &entries[n];
+		mutex_lock(&other->lock);
+		entry->dev = other;
+		for(int dir = 0; dir < ENDPOINT_DIRS; dir++) {
+			entry->original[dir] = original_interval(other, dir);
+			entry->interval[dir] = other->requested[dir] != 0 ? other->requested[dir] : entry->original[dir];
+			entry->xfer_ns[dir] = other->xfer_ns[dir];
+			entry->tt_xfer_ns[dir] = other->tt_xfer_ns[dir];
+		}
+		mutex_unlock(&other->lock);
+
+		n++;
+	}
+
+	for(;;) {
+		struct plan_entry* fastest = NULL;
+		unsigned int fastest_hz = 0;
+		int fastest_dir = 0;
+		bool any_tt_over = false;
+		bool bus_over;
+		u64 total = 0;
+
+		for(unsigned int i = 0; i < n; i++) {
+			u64 tt_total = 0;
+
+			total += entry_cost(&entries[i], entries[i].xfer_ns);
+
+			for(unsigned int j = 0; j < n && entries[i].dev->tt_hub != NULL; j++) {
+				if(same_tt(entries[i].dev, entries[j].dev)) {
+					tt_total += entry_cost(&entries[j], entries[j].tt_xfer_ns);
+				}
+			}
+
+			entries[i].tt_over = tt_total > tt_budget();
+			any_tt_over |= entries[i].tt_over;
+		}
+
+		bus_over = total > budget;
+		if(!bus_over && !any_tt_over) {
+			break;
+		}
+
+		for(unsigned int i = 0; i < n; i++) {
+			for(int dir = 0; dir < ENDPOINT_DIRS; dir++) {
+				struct usb_device* device = entries[i].dev->udev;
+				unsigned int hz = interval_to_hz(device, entries[i].interval[dir]);
+				bool involved = (bus_over && entries[i].xfer_ns[dir] != 0) || (entries[i].tt_over && entries[i].tt_xfer_ns[dir] != 0);
+
+				if(involved && hz > interval_to_hz(device, entries[i].original[dir]) && hz > fastest_hz) {
+					fastest = &entries[i];
+					fastest_hz = hz;
+					fastest_dir = dir;
+				}
+			}
+		}
+
+		/* Even the original rates do not fit, there is nothing left to give up. */
+		if(fastest == NULL) {
+			break;
+		}
+
+		fastest->interval[fastest_dir] = slower_interval(fastest->dev->udev, fastest->interval[fastest_dir], fastest->original[fastest_dir]);
+	}
+
+	for(unsigned int i = 0; i < n; i++) {
+		struct ds_oc_device* planned = entries[i].dev;
+		bool changed = false;
+
+		mutex_lock(&planned->lock);
+		for(int dir = 0; dir < ENDPOINT_DIRS; dir++) {
+			/* Keep 0 for an uncapped original interval, so it stays in sync with the snapshot. */
+			unsigned short interval = planned->requested[dir] == 0 && entries[i].interval[dir] == entries[i].original[dir] ? 0 : entries[i].interval[dir];
+
+			if(planned->planned[dir] != interval) {
+				planned->planned[dir] = interval;
+				changed = true;
+			}
+		}
+
+		if(planned == dev) {
+			memcpy(intervals, planned->planned, sizeof(planned->planned));
+		}
+		else if(changed && !planned->restoring) {
+			queue_update(planned, 0);
+		}
+		mutex_unlock(&planned->lock);
+	}
+
+	mutex_unlock(&device_list_lock);
+	kfree(entries);
+}
+
+/* class_for_each_device() callback, finds input devices of the USB device that are open. */
+static int check_input_users(struct device* device, void* data) {
+	struct usb_device* udev = data;
+
+	/* Handlers such as evdev share the class but have a device number, the input devices themselves do not. */
+	if(MAJOR(device->devt) != 0) {
+		return 0;
+	}
+
+	for(struct device* parent = device->parent; parent != NULL; parent = parent->parent) {
+		if(parent == &udev->dev) {
+			struct input_dev* input = to_input_dev(device);
+
+			/*
+			 * Only the gamepad counts. A desktop keeps the touchpad open through libinput and mousedev, and the motion sensors
+			 * may be read by the session as well, neither means a game is playing. HID drivers without a gamepad mapping
+			 * report the buttons in the joystick range.
+			 */
+			if(!test_bit(BTN_GAMEPAD, input->keybit) && !test_bit(BTN_JOYSTICK, input->keybit)) {
+				return 0;
+			}
+
+			return READ_ONCE(input->users) > 0;
+		}
+	}
+
+	return 0;
+}
+
+/* Whether a reader has the hidraw node of one of the HID interfaces open. Called with the device lock held. */
+static bool is_hidraw_open(struct usb_device* udev) {
+	struct usb_host_config* config = udev->actconfig;
+
+	if(config == NULL) {
+		return false;
+	}
+
+	for(unsigned int i = 0; i < config->desc.bNumInterfaces; i++) {
+		struct usb_interface* interface = config->interface[i];
+		struct hid_device* hid;
+
+		/* Only usbhid stores its hid_device as interface data. */
+		if(interface == NULL || interface->dev.driver == NULL || strcmp(interface->dev.driver->name, "usbhid") != 0) {
+			continue;
+		}
+
+		hid = usb_get_intfdata(interface);
+		if(hid != NULL && hid->hidraw != NULL && READ_ONCE(((struct hidraw*)hid->hidraw)->open) > 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Polls whether the controller is in use and queues an update when that changes.
+ * HID drivers such as hid-playstation keep the device open themselves, so the readers of the hidraw and input devices are checked instead.
+ */
+static void demand_work_fn(struct work_struct* work) {
+	struct ds_oc_device* dev = container_of(to_delayed_work(work), struct ds_oc_device, demand_work);
+	u64 now = ktime_get_ns();
+	bool requeued;
+	bool busy;
+
+	/* Holding the device lock keeps usbhid bound. Never wait for it, a reset or disconnect may hold it while waiting for us. */
+	if(!device_trylock(&dev->udev->dev)) {
+		mutex_lock(&dev->lock);
+		if(dev->removed || dev->restoring || !demand) {
+			mutex_unlock(&dev->lock);
+			put_device_state(dev);
+			return;
+		}
+		goto requeue;
+	}
+	busy = is_hidraw_open(dev->udev) || class_for_each_device(&input_class, NULL, dev->udev, &check_input_users) > 0;
+	device_unlock(&dev->udev->dev);
+
+	mutex_lock(&dev->lock);
+	if(dev->removed || dev->restoring || !demand) {
+		mutex_unlock(&dev->lock);
+		put_device_state(dev);
+		return;
+	}
+
+	if(busy) {
+		dev->last_use_ns = now;
+	}
+
+	busy = busy || (dev->in_use && now - dev->last_use_ns < (u64)demand_idle_ms * NSEC_PER_MSEC);
+	if(busy != dev->in_use) {
+		dev->in_use = busy;
+		pr_debug("ds_oc: Controller %s is %s, switching to the %s rate.\n", dev_name(&dev->udev->dev), busy ? "in use" : "idle", busy ? "configured" : "original");
+		queue_update(dev, 0);
+	}
+
+requeue:
+	/* Queued under dev->lock, so remove_device either sees the work pending and cancels it or we see removed set above. */
+	requeued = queue_delayed_work(apply_wq, &dev->demand_work, msecs_to_jiffies(DEMAND_POLL_MS));
+	mutex_unlock(&dev->lock);
+
+	/* If it was queued, the work inherits our reference. */
+	if(!requeued) {
+		put_device_state(dev);
+	}
+}
+
+static void start_demand(struct ds_oc_device* dev) {
+	kref_get(&dev->kref);
+	if(mod_delayed_work(apply_wq, &dev->demand_work, 0)) {
+		put_device_state(dev);
+	}
+}
+
+/* Whether the planner granted the device less than it asked for. Called with dev->lock held. */
+static bool is_capped(struct ds_oc_device* dev) {
+	return memcmp(dev->planned, dev->requested, sizeof(dev->planned)) != 0;
+}
+
+/* Patches the device to the currently configured rates. */
+static void update_device(struct ds_oc_device* dev) {
+	unsigned short intervals[ENDPOINT_DIRS];
+	bool costs_known;
+
+	mutex_lock(&dev->lock);
+	if(dev->restoring) {
+		mutex_unlock(&dev->lock);
+		return;
+	}
+
+	for(int dir = 0; dir < ENDPOINT_DIRS; dir++) {
+		intervals[dir] = target_interval(dev->udev, dir, dev->rate_hz_override);
+	}
+
+	dev->in_fallback = false;
+
+	if(demand && !dev->in_use) {
+		intervals[ENDPOINT_IN] = 0;
+		intervals[ENDPOINT_OUT] = 0;
+	}
+	else {
+		if(is_autotuned(ENDPOINT_IN) && dev->rate_hz_override == 0) {
+			if(dev->tune_state == TUNE_NONE || dev->tune_generation != tune_generation) {
+				start_tune(dev);
+			}
+
+			/* A running tune patches the device itself. */
+			if(dev->tune_state == TUNE_RUNNING) {
+				mutex_unlock(&dev->lock);
+				return;
+			}
+
+			intervals[ENDPOINT_IN] = dev->tuned_interval;
+		}
+
+		memcpy(dev->configured, intervals, sizeof(dev->configured));
+
+		/* A rate that stopped the controller is only tried again once another rate is configured. */
+		if(dev->has_failed && memcmp(intervals, dev->failed_interval, sizeof(dev->failed_interval)) != 0) {
+			dev->has_failed = false;
+		}
+		if(dev->has_failed) {
+			memcpy(intervals, dev->good_interval, sizeof(dev->good_interval));
+			dev->in_fallback = true;
+		}
+	}
+
+	memcpy(dev->requested, intervals, sizeof(dev->requested));
+	costs_known = dev->snapshots != NULL;
+	mutex_unlock(&dev->lock);
+
+	plan_bus(dev, intervals);
+	patch_endpoints(dev, intervals);
+
+	/* The first patch takes the snapshot the costs of the device come from, plan again now that they are known. */
+	if(!costs_known) {
+		mutex_lock(&dev->lock);
+		costs_known = dev->snapshots != NULL;
+		mutex_unlock(&dev->lock);
+
+		if(costs_known) {
+			plan_bus(dev, intervals);
+			patch_endpoints(dev, intervals);
+		}
+	}
+}
+
+static void apply_work_fn(struct work_struct* work) {
+	struct ds_oc_device* dev = container_of(to_delayed_work(work), struct ds_oc_device, apply_work);
+
+	update_device(dev);
+
+	mutex_lock(&dev->lock);
+	if(dev->hotplug_us == 0 && dev->status == DEVICE_STATUS_PATCHED) {
+		dev->hotplug_us = max_t(s64, ktime_us_delta(ktime_get(), dev->added_at), 1);
+		printk(KERN_INFO "ds_oc: Controller %s patched %u us after it was connected.\n", dev_name(&dev->udev->dev), dev->hotplug_us);
+	}
+	mutex_unlock(&dev->lock);
+
+	put_device_state(dev);
+}
+
+/*
+ * Schedules the device to be patched to the configured rates after delay jiffies. Does not sleep.
+ * A patch that is still pending is pushed back instead, so a burst of changes results in a single patch.
+ */
+static void queue_update(struct ds_oc_device* dev, unsigned long delay) {
+	kref_get(&dev->kref);
+	if(mod_delayed_work(apply_wq, &dev->apply_work, delay)) {
+		/* Already pending, the queued work holds its own reference. */
+		dev->coalesced++;
+		put_device_state(dev);
+	}
+}
+
+/* Schedules every managed device to be patched to the configured rates once the coalescing window has passed. */
+static void queue_update_all(void) {
+	struct ds_oc_device* dev;
+
+	mutex_lock(&device_list_lock);
+	list_for_each_entry(dev, &device_list, list) {
+		queue_update(dev, msecs_to_jiffies(coalesce_ms));
+	}
+	mutex_unlock(&device_list_lock);
+}
+
+/* Makes the next update check the descriptors and the achieved rate of the device. */
+static void revalidate_device(struct ds_oc_device* dev) {
+	mutex_lock(&dev->lock);
+	dev->revalidate = true;
+	mutex_unlock(&dev->lock);
+
+	queue_update(dev, 0);
+}
+
+static void revalidate_work_fn(struct work_struct* work) {
+	struct ds_oc_device* dev;
+
+	mutex_lock(&device_list_lock);
+	list_for_each_entry(dev, &device_list, list) {
+		bool reset_seen = false;
+
+		mutex_lock(&dev->lock);
+		if(dev->monitor != NULL && READ_ONCE(dev->monitor->reset_seen)) {
+			WRITE_ONCE(dev->monitor->reset_seen, false);
+			reset_seen = true;
+		}
+		mutex_unlock(&dev->lock);
+
+		if(reset_seen) {
+			revalidate_device(dev);
+		}
+	}
+	mutex_unlock(&device_list_lock);
+}
+
+/* A resume can bring devices back through a reset-resume or a full re-enumeration, check all of them. */
+static int on_pm_notify(struct notifier_block* self, unsigned long action, void* data) {
+	struct ds_oc_device* dev;
+
+	switch(action) {
+		case PM_POST_SUSPEND:
+		case PM_POST_HIBERNATION:
+		case PM_POST_RESTORE:
+			mutex_lock(&device_list_lock);
+			list_for_each_entry(dev, &device_list, list) {
+				revalidate_device(dev);
+			}
+			mutex_unlock(&device_list_lock);
+			break;
+	}
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block pm_nb = {
+	.notifier_call = &on_pm_notify
+};
+
+/* Must be called with device_list_lock held. */
+static struct ds_oc_device* find_device(struct usb_device* device) {
+	struct ds_oc_device* dev;
+
+	list_for_each_entry(dev, &device_list, list) {
+		if(dev->udev == device) {
+			return dev;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Walks up the hub chain to the high-speed hub whose transaction translator carries the traffic of a full- or low-speed device.
+ * Returns NULL if there is none. port is set like tt_port of struct ds_oc_device.
+ */
+static struct usb_device* lookup_tt(struct usb_device* device, int* port) {
+	struct usb_device* child = device;
+
+	*port = 0;
+
+	if(device->speed >= USB_SPEED_HIGH || device->tt == NULL) {
+		return NULL;
+	}
+
+	while(child->parent != NULL && child->parent->speed < USB_SPEED_HIGH) {
+		child = child->parent;
+	}
+
+	if(child->parent == NULL) {
+		return NULL;
+	}
+
+	/* A multi-TT hub has one translator per port, a single-TT hub shares one among all of them. */
+	*port = device->tt->multi ? child->portnum : 0;
+	return child->parent;
+}
+
+static void find_tt(struct ds_oc_device* dev) {
+	dev->tt_hub = lookup_tt(dev->udev, &dev->tt_port);
+}
+
+/* Picks the apply mode for the host controller driving the device. */
+static void choose_hcd_strategy(struct ds_oc_device* dev) {
+	struct usb_hcd* hcd = bus_to_hcd(dev->udev->bus);
+	const char* name = hcd->driver->description != NULL ? hcd->driver->description : "unknown";
+
+	strscpy(dev->hcd_name, name, sizeof(dev->hcd_name));
+	dev->hcd_mode = DEFAULT_HCD_MODE;
+
+	for(size_t i = 0; i < ARRAY_SIZE(hcd_strategies); i++) {
+		if(strncmp(name, hcd_strategies[i].prefix, strlen(hcd_strategies[i].prefix)) == 0) {
+			dev->hcd_mode = hcd_strategies[i].mode;
+			break;
+		}
+	}
+
+	pr_debug("ds_oc: Controller %s is driven by %s, new rates are applied by %s.\n", dev_name(&dev->udev->dev), dev->hcd_name, apply_mode_names[dev->hcd_mode]);
+}
+
+/*
+ * Attributes in /sys/bus/usb/devices/<device>/ds_oc. They only read and change the state of their own device,
+ * a new rate is applied like a module parameter change but to this device alone.
+ */
+static struct ds_oc_device* kobj_to_device(struct kobject* kobj) {
+	return container_of(kobj, struct ds_oc_device, kobj);
+}
+
+static ssize_t rate_show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer) {
+	struct ds_oc_device* dev = kobj_to_device(kobj);
+	unsigned int rate;
+
+	mutex_lock(&dev->lock);
+	rate = dev->rate_hz_override;
+	mutex_unlock(&dev->lock);
+
+	if(rate == RATE_ORIGINAL) {
+		return sprintf(buffer, "original\n");
+	}
+
+	return sprintf(buffer, "%u\n", rate);
+}
+
+/* Accepts a rate in Hz, 0 to follow the module parameters or "original" to keep the original intervals. */
+static ssize_t rate_store(struct kobject* kobj, struct kobj_attribute* attr, const char* buffer, size_t count) {
+	struct ds_oc_device* dev = kobj_to_device(kobj);
+	unsigned int rate;
+
+	if(sysfs_streq(buffer, "original")) {
+		rate = RATE_ORIGINAL;
+	}
+	else {
+		int ret = kstrtouint(buffer, 0, &rate);
+		if(ret) {
+			return ret;
+		}
+
+		if(rate > MICROFRAME_RATE_HZ) {
+			return -EINVAL;
+		}
+	}
+
+	mutex_lock(&dev->lock);
+	dev->rate_hz_override = rate;
+	mutex_unlock(&dev->lock);
+
+	queue_update(dev, msecs_to_jiffies(coalesce_ms));
+
+	return count;
+}
+
+static ssize_t original_show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer) {
+	struct ds_oc_device* dev = kobj_to_device(kobj);
+	ssize_t len;
+
+	mutex_lock(&dev->lock);
+	len = sprintf(buffer, "%u %u\n", interval_to_hz(dev->udev, original_interval(dev, ENDPOINT_IN)), interval_to_hz(dev->udev, original_interval(dev, ENDPOINT_OUT)));
+	mutex_unlock(&dev->lock);
+
+	return len;
+}
+
+static ssize_t achieved_show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer) {
+	struct ds_oc_device* dev = kobj_to_device(kobj);
+	ssize_t len;
+
+	mutex_lock(&dev->lock);
+	len = sprintf(buffer, "%u\n", dev->achieved_hz);
+	mutex_unlock(&dev->lock);
+
+	return len;
+}
+
+static ssize_t resets_show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer) {
+	struct ds_oc_device* dev = kobj_to_device(kobj);
+	ssize_t len;
+
+	mutex_lock(&dev->lock);
+	len = sprintf(buffer, "%u\n", dev->resets);
+	mutex_unlock(&dev->lock);
+
+	return len;
+}
+
+static ssize_t status_show(struct kobject* kobj, struct kobj_attribute* attr, char* buffer) {
+	struct ds_oc_device* dev = kobj_to_device(kobj);
+	ssize_t len;
+
+	mutex_lock(&dev->lock);
+	len = sprintf(buffer, "%s\n", device_status_names[dev->status]);
+	mutex_unlock(&dev->lock);
+
+	return len;
+}
+
+static struct kobj_attribute rate_attr = __ATTR_RW(rate);
+static struct kobj_attribute original_attr = __ATTR_RO(original);
+static struct kobj_attribute achieved_attr = __ATTR_RO(achieved);
+static struct kobj_attribute resets_attr = __ATTR_RO(resets);
+static struct kobj_attribute status_attr = __ATTR_RO(status);
+
+static struct attribute* device_attrs[] = {
+	&rate_attr.attr,
+	&original_attr.attr,
+	&achieved_attr.attr,
+	&resets_attr.attr,
+	&status_attr.attr,
+	NULL
+};
+ATTRIBUTE_GROUPS(device);
+
+static void release_device_kobj(struct kobject* kobj) {
+	put_device_state(kobj_to_device(kobj));
+}
+
+static const struct kobj_type device_ktype = {
+	.release = &release_device_kobj,
+	.sysfs_ops = &kobj_sysfs_ops,
+	.default_groups = device_groups
+};
+
+/* Creates the ds_oc directory of the device. The device works without it, only the per-device attributes are missing then. */
+static void add_device_kobj(struct ds_oc_device* dev) {
+	kref_get(&dev->kref);
+	if(kobject_init_and_add(&dev->kobj, &device_ktype, &dev->udev->dev.kobj, "ds_oc")) {
+		printk(KERN_WARNING "ds_oc: Could not create the sysfs attributes of %s.\n", dev_name(&dev->udev->dev));
+		/* Drops the reference through the release function. */
+		kobject_put(&dev->kobj);
+		return;
+	}
+
+	dev->kobj_added = true;
+}
+
+/* Waits for running attribute accesses, so it must not be called with dev->lock held. */
+static void remove_device_kobj(struct ds_oc_device* dev) {
+	if(dev->kobj_added) {
+		dev->kobj_added = false;
+		kobject_del(&dev->kobj);
+		kobject_put(&dev->kobj);
+	}
+}
+
+/* Remembers the settings of the device for the next time it is connected. Called with dev->lock held. */
+static void save_policy(struct ds_oc_device* dev) {
+	static const unsigned short original_intervals[ENDPOINT_DIRS] = { 0, 0 };
+	bool tuned = dev->tune_state == TUNE_DONE;
+	bool empty = dev->rate_hz_override == 0 && !tuned && memcmp(dev->good_interval, original_intervals, sizeof(original_intervals)) == 0;
+	char key[POLICY_KEY_LEN];
+	struct policy_entry* entry;
+
+	policy_key(dev->udev, key);
+
+	mutex_lock(&policy_lock);
+	entry = find_policy(key);
+	if(entry != NULL) {
+		list_del(&entry->list);
+		num_policies--;
+	}
+
+	if(empty) {
+		/* Nothing differs from a controller seen for the first time. */
+		kfree(entry);
+		mutex_unlock(&policy_lock);
+		return;
+	}
+
+	if(entry == NULL && num_policies == POLICY_MAX_ENTRIES) {
+		entry = list_first_entry(&policy_list, struct policy_entry, list);
+		list_del(&entry->list);
+		num_policies--;
+		memset(entry, 0, sizeof(*entry));
+	}
+	else if(entry == NULL) {
+		entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+		if(entry == NULL) {
+			mutex_unlock(&policy_lock);
+			return;
+		}
+	}
+
+	strscpy(entry->key, key, sizeof(entry->key));
+	entry->speed = dev->udev->speed;
+	entry->rate_hz_override = dev->rate_hz_override;
+	memcpy(entry->good_interval, dev->good_interval, sizeof(entry->good_interval));
+	entry->tuned = tuned;
+	entry->tune_generation = dev->tune_generation;
+	entry->tuned_interval = dev->tuned_interval;
+
+	list_add_tail(&entry->list, &policy_list);
+	num_policies++;
+	mutex_unlock(&policy_lock);
+}
+
+/* Picks up the settings the device had when it was last connected, before it is patched for the first time. */
+static void restore_policy(struct ds_oc_device* dev) {
+	struct policy_entry policy;
+
+	if(!lookup_policy(dev->udev, &policy)) {
+		return;
+	}
+
+	dev->rate_hz_override = policy.rate_hz_override;
+
+	if(policy.speed == dev->udev->speed) {
+		memcpy(dev->good_interval, policy.good_interval, sizeof(dev->good_interval));
+
+		/* A curve measured for an older rate=auto write is measured again, like for the controllers that stayed connected. */
+		if(policy.tuned && policy.tune_generation == tune_generation) {
+			dev->tune_state = TUNE_DONE;
+			dev->tune_generation = policy.tune_generation;
+			dev->tuned_interval = policy.tuned_interval;
+		}
+	}
+
+	pr_debug("ds_oc: Controller %s was connected before, restoring its settings.\n", dev_name(&dev->udev->dev));
+}
+
+/* Starts managing the device and queues it for patching. Only this device is touched, the other managed devices are left alone. */
+static void add_device(struct usb_device* device, const struct device_layout* layout) {
+	struct ds_oc_device* dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+
+	if(dev == NULL) {
+		printk(KERN_ERR "ds_oc: Could not allocate state for %s.\n", dev_name(&device->dev));
+		return;
+	}
+
+	kref_init(&dev->kref);
+	mutex_init(&dev->lock);
+	INIT_DELAYED_WORK(&dev->apply_work, &apply_work_fn);
+	INIT_DELAYED_WORK(&dev->verify_work, &verify_work_fn);
+	INIT_DELAYED_WORK(&dev->tune_work, &tune_work_fn);
+	INIT_DELAYED_WORK(&dev->demand_work, &demand_work_fn);
+	dev->added_at = ktime_get();
+	dev->udev = usb_get_dev(device);
+	dev->layout = *layout;
+	dev->status = DEVICE_STATUS_CONNECTED;
+	choose_hcd_strategy(dev);
+	find_tt(dev);
+	restore_policy(dev);
+
+	trace_ds_oc_match(dev_name(&device->dev), le16_to_cpu(device->descriptor.idVendor), le16_to_cpu(device->descriptor.idProduct), dev->hcd_name,
+		apply_mode_names[dev->hcd_mode]);
+
+	mutex_lock(&device_list_lock);
+	if(find_device(device) != NULL) {
+		/* Already picked up by the notifier while the existing devices were being scanned. */
+		mutex_unlock(&device_list_lock);
+		put_device_state(dev);
+		return;
+	}
+	/* The list keeps the initial reference. */
+	list_add_tail(&dev->list, &device_list);
+	queue_update(dev, 0);
+	if(demand) {
+		start_demand(dev);
+	}
+	add_device_kobj(dev);
+	mutex_unlock(&device_list_lock);
+
+	printk(KERN_INFO "ds_oc: Controller %s connected\n", dev_name(&device->dev));
+}
+
+static void remove_device(struct usb_device* device) {
+	struct ds_oc_device* dev;
+
+	mutex_lock(&device_list_lock);
+	dev = find_device(device);
+	if(dev != NULL) {
+		struct ds_oc_device* other;
+
+		list_del(&dev->list);
+		dev->status = DEVICE_STATUS_DISCONNECTED;
+
+		/* The bandwidth the device leaves behind may allow the capped devices on its bus to go faster. */
+		list_for_each_entry(other, &device_list, list) {
+			if(other->udev->bus == device->bus) {
+				mutex_lock(&other->lock);
+				if(is_capped(other)) {
+					queue_update(other, 0);
+				}
+				mutex_unlock(&other->lock);
+			}
+		}
+	}
+	mutex_unlock(&device_list_lock);
+
+	if(dev != NULL) {
+		remove_device_kobj(dev);
+
+		/* The descriptors live until the last reference to the device is dropped, leave them as we found them. */
+		mutex_lock(&dev->lock);
+		save_policy(dev);
+		dev->removed = true;
+		restore_snapshot(dev);
+		stop_monitor(dev);
+		mutex_unlock(&dev->lock);
+
+		if(cancel_delayed_work(&dev->apply_work)) {
+			put_device_state(dev);
+		}
+		if(cancel_delayed_work(&dev->verify_work)) {
+			put_device_state(dev);
+		}
+		if(cancel_delayed_work(&dev->tune_work)) {
+			put_device_state(dev);
+		}
+		if(cancel_delayed_work(&dev->demand_work)) {
+			put_device_state(dev);
+		}
+
+		printk(KERN_INFO "ds_oc: Controller %s disconnected\n", dev_name(&device->dev));
+		put_device_state(dev);
+	}
+}
+
+/*
+ * Fills intervals with what the device is patched to once it is managed, in the format of patch_endpoints, including its stored policy.
+ * Returns false if that is not known yet because auto-tuning still has to measure the device.
+ */
+static bool initial_intervals(struct usb_device* device, unsigned short* intervals) {
+	struct policy_entry policy;
+	bool found = lookup_policy(device, &policy);
+	unsigned int device_hz = found ? policy.rate_hz_override : 0;
+
+	for(int dir = 0; dir < ENDPOINT_DIRS; dir++) {
+		intervals[dir] = target_interval(device, dir, device_hz);
+	}
+
+	if(is_autotuned(ENDPOINT_IN) && device_hz == 0) {
+		if(!found || !policy.tuned || policy.tune_generation != tune_generation || policy.speed != device->speed) {
+			return false;
+		}
+
+		intervals[ENDPOINT_IN] = policy.tuned_interval;
+	}
+
+	return true;
+}
+
+/*
+ * Patches a device that is still connected back to its original intervals and stops managing it, dropping the reference of the list.
+ * The caller must have taken it off device_list already.
+ */
+static void unmanage_device(struct ds_oc_device* dev) {
+	static const unsigned short restore_intervals[ENDPOINT_DIRS] = { 0, 0 };
+
+	/* A rate written after this would queue another patch. */
+	remove_device_kobj(dev);
+
+	/* Keeps the works below from patching or queueing each other once they are cancelled. */
+	mutex_lock(&dev->lock);
+	dev->restoring = true;
+	mutex_unlock(&dev->lock);
+
+	/* A change still waiting for its coalescing window would only be undone right away. */
+	if(cancel_delayed_work_sync(&dev->apply_work)) {
+		put_device_state(dev);
+	}
+	if(cancel_delayed_work_sync(&dev->verify_work)) {
+		put_device_state(dev);
+	}
+	if(cancel_delayed_work_sync(&dev->tune_work)) {
+		put_device_state(dev);
+	}
+	if(cancel_delayed_work_sync(&dev->demand_work)) {
+		put_device_state(dev);
+	}
+
+	if(dev->snapshots != NULL) {
+		patch_endpoints(dev, restore_intervals);
+	}
+
+	mutex_lock(&dev->lock);
+	dev->removed = true;
+	stop_monitor(dev);
+	mutex_unlock(&dev->lock);
+
+	put_device_state(dev);
+}
+
+/* Whether the early probe should patch the device. Demand mode and controllers that still have to be tuned start at their original interval. */
+static bool wants_early_patch(struct usb_device* device, struct device_layout* layout, unsigned short* intervals) {
+	return early_patch && !demand && !device->use_generic_driver && is_overclockable(device, layout) && initial_intervals(device, intervals);
+}
+
+/* Whether the HID interrupt endpoints of the interface cache are patched, honoring the interface hint like take_snapshot. */
+static bool early_interface(struct usb_host_config* config, struct usb_interface_cache* cache, const struct device_layout* layout) {
+	bool hinted_hid = false;
+	bool is_hid = false;
+
+	for(unsigned int i = 0; i < config->desc.bNumInterfaces; i++) {
+		struct usb_interface_cache* other = config->intf_cache[i];
+
+		for(unsigned int altsetting = 0; altsetting < other->num_altsetting; altsetting++) {
+			struct usb_host_interface* altsettingptr = &other->altsetting[altsetting];
+
+			if(altsettingptr->desc.bInterfaceClass != USB_CLASS_HID) {
+				continue;
+			}
+
+			if(other == cache) {
+				is_hid = true;
+			}
+			if(altsettingptr->desc.bInterfaceNumber == layout->ifnum) {
+				hinted_hid = true;
+			}
+		}
+	}
+
+	return is_hid && (!hinted_hid || cache->altsetting[0].desc.bInterfaceNumber == layout->ifnum);
+}
+
+/* Bus time a device that is not managed yet needs, gathered from its descriptors in the format of struct plan_entry. */
+struct early_cost {
+	struct usb_device* tt_hub;
+	int tt_port;
+	unsigned short original[ENDPOINT_DIRS];
+	unsigned int xfer_ns[ENDPOINT_DIRS];
+	unsigned int tt_xfer_ns[ENDPOINT_DIRS];
+};
+
+/*
+ * Walks every configuration of the device, recording and patching its endpoints when early is not NULL and adding up their bus times
+ * when cost is not NULL. Returns the number found.
+ */
+static unsigned int early_walk(struct usb_device* device, const struct device_layout* layout, const unsigned short* intervals, struct early_patch* early,
+	struct early_cost* cost) {
+	unsigned int count = 0;
+
+	for(unsigned int c = 0; c < device->descriptor.bNumConfigurations; c++) {
+		struct usb_host_config* config = &device->config[c];
+
+		for(unsigned int i = 0; i < config->desc.bNumInterfaces; i++) {
+			struct usb_interface_cache* cache = config->intf_cache[i];
+
+			if(!early_interface(config, cache, layout)) {
+				continue;
+			}
+
+			for(unsigned int altsetting = 0; altsetting < cache->num_altsetting; altsetting++) {
+				struct usb_host_interface* altsettingptr = &cache->altsetting[altsetting];
+
+				for(__u8 endpoint = 0; endpoint < altsettingptr->desc.bNumEndpoints; endpoint++) {
+					struct usb_endpoint_descriptor* desc = &altsettingptr->endpoint[endpoint].desc;
+					int dir = endpoint_direction(layout, altsettingptr, desc);
+
+					if(dir < 0) {
+						continue;
+					}
+
+					if(cost != NULL) {
+						if(cost->original[dir] == 0) {
+							cost->original[dir] = desc->bInterval;
+						}
+						add_transfer_time(device, cost->tt_hub != NULL, desc, dir, cost->xfer_ns, cost->tt_xfer_ns);
+					}
+
+					if(early != NULL) {
+						early->endpoints[count].desc = desc;
+						early->endpoints[count].interval = desc->bInterval;
+
+						if(intervals[dir] != 0 && desc->bInterval != intervals[dir]) {
+							trace_ds_oc_patch(dev_name(&device->dev), desc->bEndpointAddress, altsettingptr->desc.bInterfaceNumber,
+								altsettingptr->desc.bAlternateSetting, desc->bInterval, intervals[dir], true);
+							desc->bInterval = intervals[dir];
+						}
+					}
+					count++;
+				}
+			}
+		}
+	}
+
+	return count;
+}
+
+/*
+ * Slows the early intervals down until the device fits into the bandwidth budgets of its bus and translator next to the managed
+ * devices there, at the rates they are planned for. Those are not slowed down for it: they keep their bandwidth until plan_bus
+ * splits the budget once the device is managed, so the host controller does not refuse to configure the new device meanwhile.
+ * If not even the original intervals fit, the device starts at them.
+ */
+static void plan_early(struct usb_device* device, const struct early_cost* cost, unsigned short* intervals) {
+	struct ds_oc_device* other;
+	u64 budget = bus_budget(device->bus);
+	u64 used = 0;
+	u64 tt_used = 0;
+
+	if(bandwidth_pct == 0) {
+		return;
+	}
+
+	mutex_lock(&device_list_lock);
+	list_for_each_entry(other, &device_list, list) {
+		if(other->udev->bus != device->bus) {
+			continue;
+		}
+
+		mutex_lock(&other->lock);
+		used += device_cost(other, other->planned, other->xfer_ns);
+		if(cost->tt_hub != NULL && other->tt_hub == cost->tt_hub && other->tt_port == cost->tt_port) {
+			tt_used += device_cost(other, other->planned, other->tt_xfer_ns);
+		}
+		mutex_unlock(&other->lock);
+	}
+	mutex_unlock(&device_list_lock);
+
+	for(;;) {
+		unsigned int fastest_hz = 0;
+		int fastest_dir = -1;
+		bool bus_over;
+		bool tt_over;
+		u64 total = used;
+		u64 tt_total = tt_used;
+
+		for(int dir = 0; dir < ENDPOINT_DIRS; dir++) {
+			unsigned int hz = interval_to_hz(device, intervals[dir] != 0 ? intervals[dir] : cost->original[dir]);
+
+			total += (u64)cost->xfer_ns[dir] * hz;
+			tt_total += (u64)cost->tt_xfer_ns[dir] * hz;
+		}
+
+		bus_over = total > budget;
+		tt_over = tt_total > tt_budget();
+		if(!bus_over && !tt_over) {
+			break;
+		}
+
+		for(int dir = 0; dir < ENDPOINT_DIRS; dir++) {
+			unsigned int hz = interval_to_hz(device, intervals[dir]);
+			bool involved = (bus_over && cost->xfer_ns[dir] != 0) || (tt_over && cost->tt_xfer_ns[dir] != 0);
+
+			if(involved && hz > interval_to_hz(device, cost->original[dir]) && hz > fastest_hz) {
+				fastest_hz = hz;
+				fastest_dir = dir;
+			}
+		}
+
+		if(fastest_dir < 0) {
+			break;
+		}
+
+		intervals[fastest_dir] = slower_interval(device, intervals[fastest_dir], cost->original[fastest_dir]);
+		if(intervals[fastest_dir] == cost->original[fastest_dir]) {
+			intervals[fastest_dir] = 0;
+		}
+	}
+}
+
+/* Binds the device to the generic driver once the early probe returned. */
+struct early_attach {
+	struct work_struct work;
+	struct usb_device* udev;
+};
+
+static void early_attach_fn(struct work_struct* work) {
+	struct early_attach* attach = container_of(work, struct early_attach, work);
+
+	if(device_attach(&attach->udev->dev) < 0) {
+		printk(KERN_ERR "ds_oc: Could not bind %s to the generic USB driver.\n", dev_name(&attach->udev->dev));
+	}
+
+	usb_put_dev(attach->udev);
+	kfree(attach);
+}
+
+static bool early_match(struct usb_device* device) {
+	struct device_layout layout;
+	unsigned short intervals[ENDPOINT_DIRS];
+
+	/* Devices already bound are reprobed when a matching driver registers, which would unbind their interface drivers. */
+	return device->dev.driver == NULL && wants_early_patch(device, &layout, intervals);
+}
+
+/*
+ * Runs while a matched device is enumerated, before it is configured and before any interface driver binds.
+ * The interrupt endpoints are patched in the parsed descriptors, so usbhid allocates its URBs with the new interval and the
+ * host controller adds the endpoints with it: the controller comes up overclocked without a reset.
+ * Returning -ENODEV hands the device to the generic driver, which configures it as usual.
+ */
+static int early_probe(struct usb_device* device) {
+	struct device_layout layout;
+	unsigned short intervals[ENDPOINT_DIRS];
+	struct early_cost cost = { 0 };
+	struct early_patch* early;
+	struct early_attach* attach;
+	unsigned int count;
+
+	if(!wants_early_patch(device, &layout, intervals)) {
+		return -ENODEV;
+	}
+
+	cost.tt_hub = lookup_tt(device, &cost.tt_port);
+	count = early_walk(device, &layout, intervals, NULL, &cost);
+	plan_early(device, &cost, intervals);
+
+	early = count != 0 ? kzalloc(struct_size(early, endpoints, count), GFP_KERNEL) : NULL;
+	if(early != NULL) {
+		early->udev = usb_get_dev(device);
+		early->count = early_walk(device, &layout, intervals, early, NULL);
+
+		mutex_lock(&early_lock);
+		list_add_tail(&early->list, &early_list);
+		mutex_unlock(&early_lock);
+
+		printk(KERN_INFO "ds_oc: Patched %u endpoints of %s before its drivers bound.\n", early->count, dev_name(&device->dev));
+	}
+
+	/* USB core defers the probe to the generic driver, attach right away instead of waiting for the next deferred probe run. */
+	attach = kzalloc(sizeof(*attach), GFP_KERNEL);
+	if(attach != NULL) {
+		INIT_WORK(&attach->work, &early_attach_fn);
+		attach->udev = usb_get_dev(device);
+		queue_work(apply_wq, &attach->work);
+	}
+
+	return -ENODEV;
+}
+
+static struct usb_device_driver early_driver = {
+	.name = "ds_oc",
+	.match = &early_match,
+	.probe = &early_probe
+};
+
+static bool early_driver_registered = false;
+
+static int on_usb_notify(struct notifier_block* self, unsigned long action, void* _device) {
+	struct usb_device* device = _device;
+	struct device_layout layout;
+
+	switch(action) {
+		case USB_DEVICE_ADD:
+			if(is_overclockable(device, &layout)) {
+				add_device(device, &layout);
+			}
+			break;
+
+		case USB_DEVICE_REMOVE:
+			/* Not looked up in the match table, the entry may have been removed since the device was added. */
+			remove_device(device);
+			drop_early_patch(device);
+			break;
+	}
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block usb_nb = { .notifier_call = on_usb_notify };
+
+static int usb_device_cb(struct usb_device* device, void* data) {
+	struct device_layout layout;
+
+	if(is_overclockable(device, &layout)) {
+		add_device(device, &layout);
+	}
+
+	return 0;
+}
+
+static int __init on_module_init(void) {
+	const struct device_layout layout = { DEFAULT_IFNUM, DEFAULT_EP_IN, DEFAULT_EP_OUT };
+
+	/* Unbound so devices on different host controllers are patched in parallel. */
+	apply_wq = alloc_workqueue("ds_oc", WQ_UNBOUND, 0);
+	if(apply_wq == NULL) {
+		return -ENOMEM;
+	}
+
+	/* Entries passed with the match parameter at load time take precedence over the built-in ones, or remove them. */
+	for(size_t i = 0; i < ARRAY_SIZE(builtin_matches); i++) {
+		if(builtin_removed[i]) {
+			continue;
+		}
+
+		if(add_match(builtin_matches[i].vid, builtin_matches[i].pid, &layout, true)) {
+			printk(KERN_ERR "ds_oc: Could not add %s to the match table.\n", builtin_matches[i].name);
+		}
+	}
+
+	if(configured_interval > 255) {
+		printk(KERN_WARNING "ds_oc: Invalid interval parameter specified.\n");
+		configured_interval = 255;
+	}
+
+	if(configured_interval == 0) {
+		printk(KERN_WARNING "ds_oc: Invalid interval parameter specified.\n");
+		configured_interval = 1;
+	}
+
+	if(configured_rate_hz > MICROFRAME_RATE_HZ) {
+		printk(KERN_WARNING "ds_oc: Invalid rate_hz parameter specified.\n");
+		configured_rate_hz = MICROFRAME_RATE_HZ;
+	}
+
+	/* Report statistics are optional, the module works without debugfs or kprobes. */
+	debugfs_root = debugfs_create_dir("ds_oc", NULL);
+	if(IS_ERR(debugfs_root)) {
+		debugfs_root = NULL;
+	}
+
+	if(register_kprobe(&giveback_probe)) {
+		printk(KERN_WARNING "ds_oc: Could not hook URB completions, report statistics are unavailable.\n");
+	}
+	else {
+		giveback_probe_registered = true;
+	}
+
+	/* Resets by other drivers are still caught on resume, where most of them happen. */
+	if(register_kretprobe(&reset_probe)) {
+		printk(KERN_WARNING "ds_oc: Could not hook device resets, rates lost to them are only reapplied after a resume.\n");
+	}
+	else {
+		reset_probe_registered = true;
+	}
+
+	register_pm_notifier(&pm_nb);
+
+	if(usb_register_device_driver(&early_driver, THIS_MODULE)) {
+		printk(KERN_WARNING "ds_oc: Could not register the early patch driver, new controllers are patched after their drivers bound.\n");
+	}
+	else {
+		early_driver_registered = true;
+	}
+
+	/* Register first so controllers plugged in while scanning are not missed, add_device ignores duplicates. */
+	usb_register_notify(&usb_nb);
+	usb_for_each_dev(NULL, &usb_device_cb);
+
+	return 0;
+}
+
+static void __exit on_module_exit(void) {
+	struct ds_oc_device* dev;
+	struct ds_oc_device* tmp;
+	struct match_entry* entry;
+	struct hlist_node* tmp_node;
+	unsigned int bucket;
+	LIST_HEAD(devices);
+
+	if(early_driver_registered) {
+		usb_deregister_device_driver(&early_driver);
+	}
+
+	usb_unregister_notify(&usb_nb);
+	unregister_pm_notifier(&pm_nb);
+
+	if(reset_probe_registered) {
+		unregister_kretprobe(&reset_probe);
+	}
+	cancel_work_sync(&revalidate_work);
+
+	/* The notifier is gone, take the list so parameter writes cannot queue any more work. */
+	mutex_lock(&device_list_lock);
+	list_splice_init(&device_list, &devices);
+	mutex_unlock(&device_list_lock);
+
+	list_for_each_entry_safe(dev, tmp, &devices, list) {
+		list_del(&dev->list);
+		unmanage_device(dev);
+	}
+
+	/* The monitors are gone, wait for completions still inside the kprobe so nothing queues the latency work any more. */
+	synchronize_rcu();
+	cancel_work_sync(&qos_work);
+	cancel_delayed_work_sync(&qos_idle_work);
+
+	mutex_lock(&qos_lock);
+	qos_release();
+	mutex_unlock(&qos_lock);
+
+	/* Also waits for pending generic driver attaches. */
+	destroy_workqueue(apply_wq);
+
+	/* Devices patched early but never managed, for example because they had no usable endpoints in their active configuration. */
+	mutex_lock(&early_lock);
+	while(!list_empty(&early_list)) {
+		struct early_patch* early = list_first_entry(&early_list, struct early_patch, list);
+
+		list_del(&early->list);
+		release_early_patch(early, NULL, false);
+	}
+	mutex_unlock(&early_lock);
+
+	while(!list_empty(&policy_list)) {
+		struct policy_entry* policy = list_first_entry(&policy_list, struct policy_entry, list);
+
+		list_del(&policy->list);
+		kfree(policy);
+	}
+
+	if(giveback_probe_registered) {
+		unregister_kprobe(&giveback_probe);
+	}
+
+	/* Lets the monitors removed above be freed before the module goes away. */
+	rcu_barrier();
+	debugfs_remove_recursive(debugfs_root);
+
+	/* No readers are left once the notifier is unregistered. */
+	hash_for_each_safe(match_table, bucket, tmp_node, entry, node) {
+		hash_del(&entry->node);
+		kfree(entry);
+	}
+}
+
+module_init(on_module_init);
+module_exit(on_module_exit);
+
+/* Accepts a raw bInterval value or "auto" to measure the fastest interval each controller honors. */
+static int on_interval_changed(const char* value, const struct kernel_param* kp) {
+	int ret;
+
+	if(sysfs_streq(value, "auto")) {
+		autotune = true;
+		tune_generation++;
+		configured_rate_hz = 0;
+
+		queue_update_all();
+
+		return 0;
+	}
+
+	ret = param_set_ushort(value, kp);
+
+	if(!ret) {
+		autotune = false;
+
+		if(configured_interval > 255) {
+			printk(KERN_WARNING "ds_oc: Invalid interval parameter specified.\n");
+			configured_interval = 255;
+		}
+		else if(configured_interval == 0) {
+			printk(KERN_WARNING "ds_oc: Invalid interval parameter specified.\n");
+			configured_interval = 1;
+		}
+
+		/* A raw bInterval value overrides a previously configured rate in Hz. */
+		configured_rate_hz = 0;
+
+		queue_update_all();
+	}
+
+	return ret;
+}
+
+static int on_interval_get(char* buffer, const struct kernel_param* kp) {
+	if(autotune) {
+		return sprintf(buffer, "auto\n");
+	}
+
+	return param_get_ushort(buffer, kp);
+}
+
+static struct kernel_param_ops interval_ops = {
+	.set = &on_interval_changed,
+	.get = &on_interval_get
+};
+
+module_param_cb(rate, &interval_ops, &configured_interval, 0644);
+MODULE_PARM_DESC(rate, "Polling rate as bInterval value, or \"auto\" to use the fastest interval that still delivers more reports (default: 1)");
+
+static int on_rate_hz_changed(const char* value, const struct kernel_param* kp) {
+	int ret = param_set_uint(value, kp);
+
+	if(!ret && configured_rate_hz > MICROFRAME_RATE_HZ) {
+		printk(KERN_WARNING "ds_oc: Invalid rate_hz parameter specified.\n");
+		configured_rate_hz = MICROFRAME_RATE_HZ;
+	}
+
+	/* Writing 0 falls back to the raw bInterval value of the rate parameter. */
+	if(!ret) {
+		queue_update_all();
+	}
+
+	return ret;
+}
+
+static struct kernel_param_ops rate_hz_ops = {
+	.set = &on_rate_hz_changed,
+	.get = &param_get_uint
+};
+
+module_param_cb(rate_hz, &rate_hz_ops, &configured_rate_hz, 0644);
+MODULE_PARM_DESC(rate_hz, "Polling rate in Hz, encoded for the link speed of each controller and rounded to the closest achievable rate. Overrides rate when not 0 (default: 0)");
+
+/* Accepts a rate in Hz, 0 to follow rate/rate_hz or "original" to keep the original interval of the endpoint. */
+static int on_dir_rate_changed(const char* value, const struct kernel_param* kp) {
+	unsigned int* rate = kp->arg;
+	unsigned int new_rate;
+
+	if(sysfs_streq(value, "original")) {
+		new_rate = RATE_ORIGINAL;
+	}
+	else {
+		int ret = kstrtouint(value, 0, &new_rate);
+		if(ret) {
+			printk(KERN_WARNING "ds_oc: Invalid %s parameter specified.\n", kp->name);
+			return ret;
+		}
+
+		if(new_rate > MICROFRAME_RATE_HZ) {
+			printk(KERN_WARNING "ds_oc: Invalid %s parameter specified.\n", kp->name);
+			new_rate = MICROFRAME_RATE_HZ;
+		}
+	}
+
+	*rate = new_rate;
+
+	queue_update_all();
+
+	return 0;
+}
+
+static int on_dir_rate_get(char* buffer, const struct kernel_param* kp) {
+	unsigned int rate = *(unsigned int*)kp->arg;
+
+	if(rate == RATE_ORIGINAL) {
+		return sprintf(buffer, "original\n");
+	}
+
+	return sprintf(buffer, "%u\n", rate);
+}
+
+static struct kernel_param_ops dir_rate_ops = {
+	.set = &on_dir_rate_changed,
+	.get = &on_dir_rate_get
+};
+
+module_param_cb(in_rate, &dir_rate_ops, &configured_dir_hz[ENDPOINT_IN], 0644);
+MODULE_PARM_DESC(in_rate, "Polling rate of the input endpoint in Hz, 0 to follow rate/rate_hz or \"original\" to keep its original interval (default: 0)");
+module_param_cb(out_rate, &dir_rate_ops, &configured_dir_hz[ENDPOINT_OUT], 0644);
+MODULE_PARM_DESC(out_rate, "Polling rate of the output endpoint in Hz, 0 to follow rate/rate_hz or \"original\" to keep its original interval (default: 0)");
+
+static int on_apply_mode_set(const char* value, const struct kernel_param* kp) {
+	int mode = sysfs_match_string(apply_mode_names, value);
+
+	if(mode < 0) {
+		printk(KERN_WARNING "ds_oc: Invalid apply parameter specified.\n");
+		return mode;
+	}
+
+	apply_mode = mode;
+
+	return 0;
+}
+
+static int on_apply_mode_get(char* buffer, const struct kernel_param* kp) {
+	return sprintf(buffer, "%s\n", apply_mode_names[apply_mode]);
+}
+
+static struct kernel_param_ops apply_mode_ops = {
+	.set = &on_apply_mode_set,
+	.get = &on_apply_mode_get
+};
+
+module_param_cb(apply, &apply_mode_ops, &apply_mode, 0644);
+MODULE_PARM_DESC(apply, "How a new bInterval value is applied: auto (chosen per host controller), reselect (re-select the interface), rebind (rebind the interface driver), reset or none (patch the descriptors only). Explicit reselect and rebind never fall back to a reset (default: auto)");
+
+module_param(coalesce_ms, uint, 0644);
+MODULE_PARM_DESC(coalesce_ms, "Rate changes within this many milliseconds are applied with a single patch per device (default: 250)");
+
+module_param(verify_ms, uint, 0644);
+MODULE_PARM_DESC(verify_ms, "Length of the report rate measurement after each patch in milliseconds, 0 to disable (default: 1000)");
+
+static int on_bandwidth_pct_changed(const char* value, const struct kernel_param* kp) {
+	int ret = param_set_uint(value, kp);
+
+	if(!ret && bandwidth_pct > 100) {
+		printk(KERN_WARNING "ds_oc: Invalid bandwidth_pct parameter specified.\n");
+		bandwidth_pct = 100;
+	}
+
+	if(!ret) {
+		queue_update_all();
+	}
+
+	return ret;
+}
+
+static struct kernel_param_ops bandwidth_pct_ops = {
+	.set = &on_bandwidth_pct_changed,
+	.get = &param_get_uint
+};
+
+module_param_cb(bandwidth_pct, &bandwidth_pct_ops, &bandwidth_pct, 0644);
+MODULE_PARM_DESC(bandwidth_pct, "Percentage of the periodic bandwidth of each bus the controllers may use together, faster rates are capped to fit, 0 to disable (default: 50)");
+
+static int on_qos_latency_changed(const char* value, const struct kernel_param* kp) {
+	int ret = param_set_int(value, kp);
+
+	/* Parameters given at load time are set before the workqueue exists, the first report picks them up. */
+	if(!ret && apply_wq != NULL) {
+		queue_work(apply_wq, &qos_work);
+	}
+
+	return ret;
+}
+
+static struct kernel_param_ops qos_latency_ops = {
+	.set = &on_qos_latency_changed,
+	.get = &param_get_int
+};
+
+module_param_cb(qos_latency_us, &qos_latency_ops, &qos_latency_us, 0644);
+MODULE_PARM_DESC(qos_latency_us, "CPU latency bound in microseconds held while an overclocked controller delivers reports, -1 to disable (default: -1)");
+
+static int on_qos_idle_changed(const char* value, const struct kernel_param* kp) {
+	unsigned int idle_ms;
+	int ret = kstrtouint(value, 0, &idle_ms);
+
+	if(ret) {
+		return ret;
+	}
+
+	/* With 0 the request would never be added, while every report queued the work to try. */
+	if(idle_ms == 0) {
+		printk(KERN_WARNING "ds_oc: Invalid qos_idle_ms parameter specified.\n");
+		return -EINVAL;
+	}
+
+	WRITE_ONCE(qos_idle_ms, idle_ms);
+	return 0;
+}
+
+static struct kernel_param_ops qos_idle_ops = {
+	.set = &on_qos_idle_changed,
+	.get = &param_get_uint
+};
+
+module_param_cb(qos_idle_ms, &qos_idle_ops, &qos_idle_ms, 0644);
+MODULE_PARM_DESC(qos_idle_ms, "Drop the CPU latency request after no overclocked controller delivered a report for this many milliseconds, must not be 0 (default: 5000)");
+
+static int on_demand_changed(const char* value, const struct kernel_param* kp) {
+	struct ds_oc_device* dev;
+	int ret = param_set_bool(value, kp);
+
+	if(ret) {
+		return ret;
+	}
+
+	/* Devices added later start polling themselves. */
+	mutex_lock(&device_list_lock);
+	list_for_each_entry(dev, &device_list, list) {
+		if(demand) {
+			/* Running devices are at the configured rate, the first poll drops the idle ones to the original rate. */
+			mutex_lock(&dev->lock);
+			dev->in_use = true;
+			dev->last_use_ns = 0;
+			mutex_unlock(&dev->lock);
+
+			start_demand(dev);
+		}
+		else {
+			queue_update(dev, 0);
+		}
+	}
+	mutex_unlock(&device_list_lock);
+
+	return 0;
+}
+
+static struct kernel_param_ops demand_ops = {
+	.set = &on_demand_changed,
+	.get = &param_get_bool
+};
+
+module_param_cb(demand, &demand_ops, &demand, 0644);
+MODULE_PARM_DESC(demand, "Keep controllers at their original interval unless a reader has their hidraw or input device open (default: 0)");
+
+module_param(demand_idle_ms, uint, 0644);
+MODULE_PARM_DESC(demand_idle_ms, "Keep the configured rate for this many milliseconds after the last reader closed the controller (default: 10000)");
+
+module_param(early_patch, bool, 0644);
+MODULE_PARM_DESC(early_patch, "Patch newly plugged controllers before their drivers bind, so they need no reset (default: 1)");
+
+module_param(autotune_ms, uint, 0644);
+MODULE_PARM_DESC(autotune_ms, "Length of the report rate measurement of each interval tried by rate=auto in milliseconds (default: 500)");
+
+/* Prints one line per managed controller. */
+static int on_devices_get(char* buffer, const struct kernel_param* kp) {
+	struct ds_oc_device* dev;
+	int len = 0;
+
+	mutex_lock(&device_list_lock);
+	list_for_each_entry(dev, &device_list, list) {
+		mutex_lock(&dev->lock);
+		len += scnprintf(buffer + len, PAGE_SIZE - len, "%s %04x:%04x rate=%u/%u hz=%u/%u original=%u/%u status=%s path=%s time_us=%u hotplug_us=%u coalesced=%u verify=%s achieved_hz=%u tune=%s tuned=%u hcd=%s strategy=%s capped=%s tt=%s:%d in_use=%d reapplied=%u\n",
+			dev_name(&dev->udev->dev), le16_to_cpu(dev->udev->descriptor.idVendor), le16_to_cpu(dev->udev->descriptor.idProduct),
+			dev->interval[ENDPOINT_IN], dev->interval[ENDPOINT_OUT], dev->rate_hz[ENDPOINT_IN], dev->rate_hz[ENDPOINT_OUT],
+			original_interval(dev, ENDPOINT_IN), original_interval(dev, ENDPOINT_OUT), device_status_names[dev->status], apply_path_names[dev->apply_path], dev->apply_us, dev->hotplug_us, dev->coalesced,
+			verify_result_names[dev->verify_result], dev->achieved_hz, tune_state_names[dev->tune_state], dev->tuned_interval,
+			dev->hcd_name, apply_mode_names[dev->hcd_mode], is_capped(dev) ? "yes" : "no",
+			dev->tt_hub != NULL ? dev_name(&dev->tt_hub->dev) : "none", dev->tt_port, dev->in_use, dev->reapplied);
+		mutex_unlock(&dev->lock);
+	}
+	mutex_unlock(&device_list_lock);
+
+	return len;
+}
+
+static struct kernel_param_ops devices_ops = {
+	.get = &on_devices_get
+};
+
+module_param_cb(devices, &devices_ops, NULL, 0444);
+MODULE_PARM_DESC(devices, "Managed controllers with their in/out rate, original rate, status and how the rate was applied (read-only)");
+
+/*
+ * Prints the bandwidth plan of every bus with managed controllers: the budget and the bus time the requested and the granted rates take,
+ * all in microseconds per second.
+ */
+static int on_bandwidth_get(char* buffer, const struct kernel_param* kp) {
+	struct ds_oc_device* dev;
+	int len = 0;
+
+	mutex_lock(&device_list_lock);
+	list_for_each_entry(dev, &device_list, list) {
+		struct ds_oc_device* other;
+		u64 requested = 0;
+		u64 planned = 0;
+		unsigned int count = 0;
+		bool first = true;
+
+		/* Each bus is printed once, at its first device in the list. */
+		list_for_each_entry(other, &device_list, list) {
+			if(other == dev) {
+				break;
+			}
+			if(other->udev->bus == dev->udev->bus) {
+				first = false;
+				break;
+			}
+		}
+
+		if(!first) {
+			continue;
+		}
+
+		list_for_each_entry(other, &device_list, list) {
+			if(other->udev->bus != dev->udev->bus) {
+				continue;
+			}
+
+			mutex_lock(&other->lock);
+			requested += device_cost(other, other->requested, other->xfer_ns);
+			planned += device_cost(other, other->planned, other->xfer_ns);
+			count++;
+			mutex_unlock(&other->lock);
+		}
+
+		len += scnprintf(buffer + len, PAGE_SIZE - len, "bus %d devices=%u budget_us=%llu requested_us=%llu planned_us=%llu\n", dev->udev->bus->busnum, count,
+			div_u64(bus_budget(dev->udev->bus), NSEC_PER_USEC), div_u64(requested, NSEC_PER_USEC), div_u64(planned, NSEC_PER_USEC));
+	}
+
+	/* Transaction translators follow the same pattern, keyed by hub and port. */
+	list_for_each_entry(dev, &device_list, list) {
+		struct ds_oc_device* other;
+		u64 requested = 0;
+		u64 planned = 0;
+		unsigned int count = 0;
+		bool first = true;
+
+		if(dev->tt_hub == NULL) {
+			continue;
+		}
+
+		list_for_each_entry(other, &device_list, list) {
+			if(other == dev) {
+				break;
+			}
+			if(same_tt(other, dev)) {
+				first = false;
+				break;
+			}
+		}
+
+		if(!first) {
+			continue;
+		}
+
+		list_for_each_entry(other, &device_list, list) {
+			if(!same_tt(other, dev)) {
+				continue;
+			}
+
+			mutex_lock(&other->lock);
+			requested += device_cost(other, other->requested, other->tt_xfer_ns);
+			planned += device_cost(other, other->planned, other->tt_xfer_ns);
+			count++;
+			mutex_unlock(&other->lock);
+		}
+
+		len += scnprintf(buffer + len, PAGE_SIZE - len, "tt %s:%d devices=%u budget_us=%llu requested_us=%llu planned_us=%llu\n", dev_name(&dev->tt_hub->dev), dev->tt_port, count,
+			div_u64(tt_budget(), NSEC_PER_USEC), div_u64(requested, NSEC_PER_USEC), div_u64(planned, NSEC_PER_USEC));
+	}
+	mutex_unlock(&device_list_lock);
+
+	return len;
+}
+
+static struct kernel_param_ops bandwidth_ops = {
+	.get = &on_bandwidth_get
+};
+
+module_param_cb(bandwidth, &bandwidth_ops, NULL, 0444);
+MODULE_PARM_DESC(bandwidth, "Periodic bus time per bus and transaction translator with managed controllers: budget, requested and granted in microseconds per second (read-only)");
+
+/* Prints the auto-tuning curve of every managed controller as bInterval:Hz=reports/unique per second, the chosen point marked with '*'. */
+static int on_tune_curve_get(char* buffer, const struct kernel_param* kp) {
+	struct ds_oc_device* dev;
+	int len = 0;
+
+	mutex_lock(&device_list_lock);
+	list_for_each_entry(dev, &device_list, list) {
+		unsigned int measured;
+
+		mutex_lock(&dev->lock);
+		len += scnprintf(buffer + len, PAGE_SIZE - len, "%s %s", dev_name(&dev->udev->dev), tune_state_names[dev->tune_state]);
+
+		/* An idle controller stops tuning at the point it measured no reports on. */
+		measured = min(dev->tune_step + (dev->tune_state == TUNE_IDLE ? 1 : 0), dev->tune_steps);
+		for(unsigned int i = 0; i < measured; i++) {
+			const struct tune_point* point = &dev->tune_curve[i];
+
+			len += scnprintf(buffer + len, PAGE_SIZE - len, " %u:%u=%u/%u%s", point->interval, point->hz, point->reports_hz, point->unique_hz,
+				dev->tune_state == TUNE_DONE && point->interval == dev->tuned_interval ? "*" : "");
+		}
+
+		len += scnprintf(buffer + len, PAGE_SIZE - len, "\n");
+		mutex_unlock(&dev->lock);
+	}
+	mutex_unlock(&device_list_lock);
+
+	return len;
+}
+
+static struct kernel_param_ops tune_curve_ops = {
+	.get = &on_tune_curve_get
+};
+
+module_param_cb(tune_curve, &tune_curve_ops, NULL, 0444);
+MODULE_PARM_DESC(tune_curve, "Report rates measured by rate=auto per controller as bInterval:Hz=reports/unique per second (read-only)");
+
+/* Prints the remembered settings of every controller seen so far, from the least to the most recently disconnected one. */
+static int on_policies_get(char* buffer, const struct kernel_param* kp) {
+	struct policy_entry* entry;
+	int len = 0;
+
+	mutex_lock(&policy_lock);
+	list_for_each_entry(entry, &policy_list, list) {
+		len += scnprintf(buffer + len, PAGE_SIZE - len, "%s", entry->key);
+
+		if(entry->rate_hz_override == RATE_ORIGINAL) {
+			len += scnprintf(buffer + len, PAGE_SIZE - len, " rate=original");
+		}
+		else {
+			len += scnprintf(buffer + len, PAGE_SIZE - len, " rate=%u", entry->rate_hz_override);
+		}
+
+		len += scnprintf(buffer + len, PAGE_SIZE - len, " good=%u/%u", entry->good_interval[ENDPOINT_IN], entry->good_interval[ENDPOINT_OUT]);
+
+		/* Results of an older rate=auto write are no longer used. */
+		if(entry->tuned && entry->tune_generation == tune_generation) {
+			len += scnprintf(buffer + len, PAGE_SIZE - len, " tuned=%u\n", entry->tuned_interval);
+		}
+		else {
+			len += scnprintf(buffer + len, PAGE_SIZE - len, " tuned=none\n");
+		}
+	}
+	mutex_unlock(&policy_lock);
+
+	return len;
+}
+
+static struct kernel_param_ops policies_ops = {
+	.get = &on_policies_get
+};
+
+module_param_cb(policies, &policies_ops, NULL, 0444);
+MODULE_PARM_DESC(policies, "Settings remembered per controller across replugs, keyed by serial number or port (read-only)");
+
+/* Restores and releases the managed controllers with the vid:pid of a removed match entry. */
+static void unmanage_matching(u16 vid, u16 pid) {
+	struct ds_oc_device* dev;
+	struct ds_oc_device* tmp;
+	LIST_HEAD(devices);
+
+	mutex_lock(&device_list_lock);
+	list_for_each_entry_safe(dev, tmp, &device_list, list) {
+		if(le16_to_cpu(dev->udev->descriptor.idVendor) == vid && le16_to_cpu(dev->udev->descriptor.idProduct) == pid) {
+			list_move_tail(&dev->list, &devices);
+		}
+	}
+	mutex_unlock(&device_list_lock);
+
+	if(list_empty(&devices)) {
+		return;
+	}
+
+	list_for_each_entry_safe(dev, tmp, &devices, list) {
+		printk(KERN_INFO "ds_oc: Controller %s no longer matches, restoring its original intervals.\n", dev_name(&dev->udev->dev));
+		list_del(&dev->list);
+		unmanage_device(dev);
+	}
+
+	/* The bandwidth they leave behind may allow capped controllers to go faster. */
+	queue_update_all();
+}
+
+/*
+ * Parses a comma separated list of vid:pid[:interface[:in_endpoint[:out_endpoint]]] entries, all values in hex except the interface number.
+ * An entry prefixed with '-' removes the device from the match table instead.
+ */
+static int on_match_set(const char* value, const struct kernel_param* kp) {
+	char* buffer = kstrdup(value, GFP_KERNEL);
+	char* cursor = buffer;
+	bool added = false;
+	char* token;
+	int ret = 0;
+
+	if(buffer == NULL) {
+		return -ENOMEM;
+	}
+
+	while(!ret && (token = strsep(&cursor, ",")) != NULL) {
+		struct device_layout layout = { DEFAULT_IFNUM, DEFAULT_EP_IN, DEFAULT_EP_OUT };
+		bool remove = false;
+		u16 vid, pid;
+
+		token = strim(token);
+		if(*token == '\0') {
+			continue;
+		}
+
+		if(*token == '-') {
+			remove = true;
+			token++;
+		}
+
+		if(sscanf(token, "%hx:%hx:%hhu:%hhx:%hhx", &vid, &pid, &layout.ifnum, &layout.ep_in, &layout.ep_out) < 2) {
+			printk(KERN_WARNING "ds_oc: Invalid match parameter specified.\n");
+			ret = -EINVAL;
+		}
+		else if(remove && apply_wq == NULL) {
+			/* Load time: the built-in entries are only added once the module is initialized, so remember to skip them instead. */
+			bool found = !remove_match(vid, pid);
+
+			for(size_t i = 0; i < ARRAY_SIZE(builtin_matches); i++) {
+				if(builtin_matches[i].vid == vid && builtin_matches[i].pid == pid) {
+					builtin_removed[i] = true;
+					found = true;
+				}
+			}
+
+			if(!found) {
+				printk(KERN_WARNING "ds_oc: Ignoring removal of %04x:%04x, it is not in the match table.\n", vid, pid);
+			}
+		}
+		else if(remove) {
+			ret = remove_match(vid, pid);
+			if(!ret) {
+				unmanage_matching(vid, pid);
+			}
+		}
+		else if(!(layout.ep_in & USB_DIR_IN) || (layout.ep_out & USB_DIR_IN)) {
+			printk(KERN_WARNING "ds_oc: Invalid endpoint addresses in match parameter.\n");
+			ret = -EINVAL;
+		}
+		else {
+			ret = add_match(vid, pid, &layout, false);
+			added = added || !ret;
+		}
+	}
+
+	kfree(buffer);
+
+	/* Pick up controllers that are already connected. Entries given at load time are scanned once the module is initialized. */
+	if(added && apply_wq != NULL) {
+		usb_for_each_dev(NULL, &usb_device_cb);
+	}
+
+	return ret;
+}
+
+static int on_match_get(char* buffer, const struct kernel_param* kp) {
+	struct match_entry* entry;
+	unsigned int bucket;
+	int len = 0;
+
+	mutex_lock(&match_table_lock);
+	hash_for_each(match_table, bucket, entry, node) {
+		len += scnprintf(buffer + len, PAGE_SIZE - len, "%04x:%04x:%u:%02x:%02x\n", entry->vid, entry->pid, entry->layout.ifnum, entry->layout.ep_in, entry->layout.ep_out);
+	}
+	mutex_unlock(&match_table_lock);
+
+	return len;
+}
+
+static struct kernel_param_ops match_ops = {
+	.set = &on_match_set,
+	.get = &on_match_get
+};
+
+module_param_cb(match, &match_ops, NULL, 0644);
+MODULE_PARM_DESC(match, "Adds devices to the match table as vid:pid[:interface[:in_endpoint[:out_endpoint]]], prefix with '-' to remove (default: DualSense, DualSense Edge and DualShock 4 on interface 3, endpoints 84 and 03)");
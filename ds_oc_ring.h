@@ -0,0 +1,43 @@
+#ifndef DS_OC_RING_H
+#define DS_OC_RING_H
+
+#include <linux/types.h>
+
+/*
+ * Layout of the report timestamp ring exported through /dev/ds_oc/<device>.
+ * Shared between the kernel module and userspace, map it read-only with mmap(2).
+ *
+ * The mapping starts with a struct ds_oc_ring_header, the entries start at data_offset.
+ * head counts every report ever written, report n is stored in entry n % num_entries.
+ * The producer fills an entry, then writes its index, then head, with a write barrier before each of the two stores.
+ * A consumer reads head with acquire semantics, copies report n and then reads head again: the copy is valid if that
+ * second head is still below n + num_entries and the copied index matches n, otherwise the consumer fell behind and
+ * the entry was overwritten.
+ */
+
+#define DS_OC_RING_VERSION 1
+#define DS_OC_RING_ENTRIES 16384
+
+struct ds_oc_ring_entry {
+	/* Completion time of the transfer on CLOCK_MONOTONIC. */
+	__u64 timestamp_ns;
+	/* Low 32 bits of the report number. */
+	__u32 index;
+	__u16 length;
+	/* First byte of the report and the sequence byte at DS_OC_RING_SEQ_OFFSET, 0 if the report is shorter. */
+	__u8 report_id;
+	__u8 report_seq;
+};
+
+/* Offset of the sequence counter in DualSense and DualShock 4 USB input reports (upper 6 bits on the DualShock 4). */
+#define DS_OC_RING_SEQ_OFFSET 7
+
+struct ds_oc_ring_header {
+	__u32 version;
+	__u32 entry_size;
+	__u32 num_entries;
+	__u32 data_offset;
+	__u64 head;
+};
+
+#endif
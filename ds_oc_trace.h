@@ -0,0 +1,167 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ds_oc
+
+#if !defined(DS_OC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define DS_OC_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Tracepoints of the module, found under events/ds_oc in tracefs.
+ * Devices are identified by their USB device name (for example 1-2) so the events line up with the ones of the USB core and usbhid.
+ */
+
+#define DS_OC_TRACE_NAME_LEN 24
+#define DS_OC_TRACE_LABEL_LEN 12
+
+/* A controller was picked up by the match table. */
+TRACE_EVENT(ds_oc_match,
+	TP_PROTO(const char* name, u16 vid, u16 pid, const char* hcd, const char* strategy),
+	TP_ARGS(name, vid, pid, hcd, strategy),
+
+	TP_STRUCT__entry(
+		__array(char, name, DS_OC_TRACE_NAME_LEN)
+		__field(u16, vid)
+		__field(u16, pid)
+		__array(char, hcd, DS_OC_TRACE_LABEL_LEN)
+		__array(char, strategy, DS_OC_TRACE_LABEL_LEN)
+	),
+
+	TP_fast_assign(
+		strscpy(__entry->name, name, sizeof(__entry->name));
+		__entry->vid = vid;
+		__entry->pid = pid;
+		strscpy(__entry->hcd, hcd, sizeof(__entry->hcd));
+		strscpy(__entry->strategy, strategy, sizeof(__entry->strategy));
+	),
+
+	TP_printk("%s %04x:%04x hcd=%s strategy=%s", __entry->name, __entry->vid, __entry->pid, __entry->hcd, __entry->strategy)
+);
+
+/* The bInterval value of an endpoint descriptor was changed, before or after the interface drivers bound. */
+TRACE_EVENT(ds_oc_patch,
+	TP_PROTO(const char* name, u8 endpoint, u8 interface, u8 altsetting, u8 old_interval, u8 new_interval, bool early),
+	TP_ARGS(name, endpoint, interface, altsetting, old_interval, new_interval, early),
+
+	TP_STRUCT__entry(
+		__array(char, name, DS_OC_TRACE_NAME_LEN)
+		__field(u8, endpoint)
+		__field(u8, interface)
+		__field(u8, altsetting)
+		__field(u8, old_interval)
+		__field(u8, new_interval)
+		__field(bool, early)
+	),
+
+	TP_fast_assign(
+		strscpy(__entry->name, name, sizeof(__entry->name));
+		__entry->endpoint = endpoint;
+		__entry->interface = interface;
+		__entry->altsetting = altsetting;
+		__entry->old_interval = old_interval;
+		__entry->new_interval = new_interval;
+		__entry->early = early;
+	),
+
+	TP_printk("%s ep=0x%02x if=%u alt=%u interval=%u->%u%s", __entry->name, __entry->endpoint, __entry->interface, __entry->altsetting,
+		__entry->old_interval, __entry->new_interval, __entry->early ? " early" : "")
+);
+
+/* The module starts to re-select, rebind or reset a controller to apply new intervals. */
+TRACE_EVENT(ds_oc_reset_begin,
+	TP_PROTO(const char* name, const char* method),
+	TP_ARGS(name, method),
+
+	TP_STRUCT__entry(
+		__array(char, name, DS_OC_TRACE_NAME_LEN)
+		__array(char, method, DS_OC_TRACE_LABEL_LEN)
+	),
+
+	TP_fast_assign(
+		strscpy(__entry->name, name, sizeof(__entry->name));
+		strscpy(__entry->method, method, sizeof(__entry->method));
+	),
+
+	TP_printk("%s method=%s", __entry->name, __entry->method)
+);
+
+TRACE_EVENT(ds_oc_reset_end,
+	TP_PROTO(const char* name, const char* method, int error, u64 duration_ns),
+	TP_ARGS(name, method, error, duration_ns),
+
+	TP_STRUCT__entry(
+		__array(char, name, DS_OC_TRACE_NAME_LEN)
+		__array(char, method, DS_OC_TRACE_LABEL_LEN)
+		__field(int, error)
+		__field(u64, duration_us)
+	),
+
+	TP_fast_assign(
+		strscpy(__entry->name, name, sizeof(__entry->name));
+		strscpy(__entry->method, method, sizeof(__entry->method));
+		__entry->error = error;
+		__entry->duration_us = div_u64(duration_ns, NSEC_PER_USEC);
+	),
+
+	TP_printk("%s method=%s error=%d duration_us=%llu", __entry->name, __entry->method, __entry->error, __entry->duration_us)
+);
+
+/* The report rate measured after a patch was compared with the requested one. */
+TRACE_EVENT(ds_oc_verify,
+	TP_PROTO(const char* name, unsigned int requested_hz, unsigned int achieved_hz, const char* result),
+	TP_ARGS(name, requested_hz, achieved_hz, result),
+
+	TP_STRUCT__entry(
+		__array(char, name, DS_OC_TRACE_NAME_LEN)
+		__field(unsigned int, requested_hz)
+		__field(unsigned int, achieved_hz)
+		__array(char, result, DS_OC_TRACE_LABEL_LEN)
+	),
+
+	TP_fast_assign(
+		strscpy(__entry->name, name, sizeof(__entry->name));
+		__entry->requested_hz = requested_hz;
+		__entry->achieved_hz = achieved_hz;
+		strscpy(__entry->result, result, sizeof(__entry->result));
+	),
+
+	TP_printk("%s requested_hz=%u achieved_hz=%u result=%s", __entry->name, __entry->requested_hz, __entry->achieved_hz, __entry->result)
+);
+
+/*
+ * An input report arrived on the monitored endpoint. Fires from the URB completion path, delta_ns is the time since the
+ * previous report and 0 for the first one.
+ */
+TRACE_EVENT(ds_oc_report,
+	TP_PROTO(const char* name, u8 endpoint, u32 length, u8 report_id, u8 seq, u64 delta_ns),
+	TP_ARGS(name, endpoint, length, report_id, seq, delta_ns),
+
+	TP_STRUCT__entry(
+		__array(char, name, DS_OC_TRACE_NAME_LEN)
+		__field(u8, endpoint)
+		__field(u32, length)
+		__field(u8, report_id)
+		__field(u8, seq)
+		__field(u64, delta_ns)
+	),
+
+	TP_fast_assign(
+		strscpy(__entry->name, name, sizeof(__entry->name));
+		__entry->endpoint = endpoint;
+		__entry->length = length;
+		__entry->report_id = report_id;
+		__entry->seq = seq;
+		__entry->delta_ns = delta_ns;
+	),
+
+	TP_printk("%s ep=0x%02x len=%u id=0x%02x seq=%u delta_ns=%llu", __entry->name, __entry->endpoint, __entry->length, __entry->report_id,
+		__entry->seq, __entry->delta_ns)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE ds_oc_trace
+#include <trace/define_trace.h>
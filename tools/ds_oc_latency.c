@@ -0,0 +1,488 @@
+/*
+ * Measures the input report timing of a DualSense or DualShock 4 controller from userspace.
+ *
+ * Every report read from the hidraw node is timestamped with CLOCK_MONOTONIC_RAW right after read() returns. The report counter
+ * and the sensor timestamp of the controller are parsed from the report. At the end the tool prints the report rate, percentiles of
+ * the time between reports, dropped and duplicate reports and the skew between the controller's clock and the arrival times, next
+ * to what ds_oc configured for the controller.
+ *
+ * Usage: ds_oc_latency [-d seconds] [-n reports] [-b] [/dev/hidrawN]
+ * Without a node the first DualSense or DualShock 4 found is used.
+ */
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SONY_VID 0x054c
+
+/* USB input report of the DualSense: report ID 0x01, sequence number at byte 7, sensor timestamp in units of 1/3 us at byte 28. */
+#define DS_REPORT_ID 0x01
+#define DS_REPORT_SIZE 64
+#define DS_SEQ_OFFSET 7
+#define DS_TIMESTAMP_OFFSET 28
+
+/* USB input report of the DualShock 4: 6 bit counter in the upper bits of byte 7, 16 bit sensor timestamp in units of 16/3 us at byte 10. */
+#define DS4_REPORT_ID 0x01
+#define DS4_REPORT_SIZE 64
+#define DS4_SEQ_OFFSET 7
+#define DS4_TIMESTAMP_OFFSET 10
+
+#define MAX_REPORT_SIZE 128
+#define DEFAULT_SECONDS 10
+
+enum controller_type {
+	CONTROLLER_DUALSENSE,
+	CONTROLLER_DUALSHOCK4
+};
+
+struct controller_model {
+	unsigned int pid;
+	enum controller_type type;
+	const char* name;
+};
+
+static const struct controller_model models[] = {
+	{ 0x0ce6, CONTROLLER_DUALSENSE, "DualSense" },
+	{ 0x0df2, CONTROLLER_DUALSENSE, "DualSense Edge" },
+	{ 0x05c4, CONTROLLER_DUALSHOCK4, "DualShock 4" },
+	{ 0x09cc, CONTROLLER_DUALSHOCK4, "DualShock 4 (2nd gen)" }
+};
+
+/* Per report: arrival on the host and the device's clock unwrapped to nanoseconds. */
+struct sample {
+	uint64_t host_ns;
+	uint64_t device_ns;
+};
+
+static volatile sig_atomic_t stop = 0;
+
+static void on_signal(int signal) {
+	(void)signal;
+	stop = 1;
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static int compare_u64(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static int compare_s64(const void* a, const void* b) {
+	int64_t x = *(const int64_t*)a;
+	int64_t y = *(const int64_t*)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of a sorted array. */
+static size_t percentile_index(size_t count, double percent) {
+	size_t rank = (size_t)ceil(percent / 100.0 * (double)count);
+
+	return rank == 0 ? 0 : rank - 1;
+}
+
+static bool read_file(const char* path, char* buffer, size_t size) {
+	FILE* file = fopen(path, "r");
+	size_t len;
+
+	if(file == NULL) {
+		return false;
+	}
+
+	len = fread(buffer, 1, size - 1, file);
+	fclose(file);
+
+	buffer[len] = '\0';
+	while(len > 0 && (buffer[len - 1] == '\n' || buffer[len - 1] == ' ')) {
+		buffer[--len] = '\0';
+	}
+
+	return true;
+}
+
+/* Looks up the model from the HID_ID line of the hidraw node's HID device, NULL if it is not a supported controller. */
+static const struct controller_model* hidraw_model(const char* name) {
+	char path[PATH_MAX];
+	char uevent[1024];
+	unsigned int bus, vid, pid;
+	const char* line;
+
+	snprintf(path, sizeof(path), "/sys/class/hidraw/%s/device/uevent", name);
+	if(!read_file(path, uevent, sizeof(uevent))) {
+		return NULL;
+	}
+
+	line = strstr(uevent, "HID_ID=");
+	if(line == NULL || sscanf(line, "HID_ID=%x:%x:%x", &bus, &vid, &pid) != 3 || vid != SONY_VID) {
+		return NULL;
+	}
+
+	/* Only USB, the Bluetooth reports have a different layout. */
+	if(bus != 0x03) {
+		return NULL;
+	}
+
+	for(size_t i = 0; i < sizeof(models) / sizeof(models[0]); i++) {
+		if(models[i].pid == pid) {
+			return &models[i];
+		}
+	}
+
+	return NULL;
+}
+
+/* Finds the first supported controller, fills node with its /dev path. */
+static const struct controller_model* find_controller(char* node, size_t size) {
+	DIR* dir = opendir("/sys/class/hidraw");
+	const struct controller_model* model = NULL;
+	struct dirent* entry;
+
+	if(dir == NULL) {
+		return NULL;
+	}
+
+	while(model == NULL && (entry = readdir(dir)) != NULL) {
+		if(strncmp(entry->d_name, "hidraw", 6) != 0) {
+			continue;
+		}
+
+		model = hidraw_model(entry->d_name);
+		if(model != NULL) {
+			snprintf(node, size, "/dev/%s", entry->d_name);
+		}
+	}
+
+	closedir(dir);
+	return model;
+}
+
+static void print_attribute(const char* dir, const char* name, const char* label) {
+	char path[PATH_MAX];
+	char value[256];
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if(read_file(path, value, sizeof(value))) {
+		printf("  %-18s %s\n", label, value);
+	}
+}
+
+/* Prints what ds_oc configured: the module parameters and the attributes of the controller's USB device. */
+static void print_configuration(const char* hidraw_name) {
+	static const char* const params[] = { "rate", "rate_hz", "in_rate", "out_rate", "apply", "demand" };
+	char path[PATH_MAX];
+	char usb_dir[PATH_MAX];
+
+	printf("ds_oc configuration:\n");
+
+	if(access("/sys/module/ds_oc", F_OK) != 0) {
+		printf("  module not loaded\n");
+		return;
+	}
+
+	for(size_t i = 0; i < sizeof(params) / sizeof(params[0]); i++) {
+		print_attribute("/sys/module/ds_oc/parameters", params[i], params[i]);
+	}
+
+	/* hidrawN/device is the HID device, its parent the USB interface and that one's parent the USB device. */
+	snprintf(path, sizeof(path), "/sys/class/hidraw/%s/device/../../ds_oc", hidraw_name);
+	if(realpath(path, usb_dir) == NULL) {
+		printf("  controller not managed by ds_oc\n");
+		return;
+	}
+
+	print_attribute(usb_dir, "rate", "device rate");
+	print_attribute(usb_dir, "original", "original Hz");
+	print_attribute(usb_dir, "achieved", "achieved Hz");
+	print_attribute(usb_dir, "resets", "resets");
+	print_attribute(usb_dir, "status", "status");
+}
+
+static void usage(const char* program) {
+	fprintf(stderr, "Usage: %s [-d seconds] [-n reports] [-b] [/dev/hidrawN]\n", program);
+	fprintf(stderr, "  -d  measure for this many seconds (default %d)\n", DEFAULT_SECONDS);
+	fprintf(stderr, "  -n  stop after this many reports\n");
+	fprintf(stderr, "  -b  busy-poll with non-blocking reads instead of waiting in epoll\n");
+}
+
+int main(int argc, char** argv) {
+	const struct controller_model* model = NULL;
+	char node[PATH_MAX] = "";
+	const char* hidraw_name;
+	double seconds = DEFAULT_SECONDS;
+	size_t max_reports = 0;
+	bool busy_poll = false;
+	int opt;
+
+	while((opt = getopt(argc, argv, "d:n:bh")) != -1) {
+		switch(opt) {
+			case 'd':
+				seconds = atof(optarg);
+				break;
+			case 'n':
+				max_reports = strtoul(optarg, NULL, 0);
+				break;
+			case 'b':
+				busy_poll = true;
+				break;
+			default:
+				usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if(optind < argc) {
+		snprintf(node, sizeof(node), "%s", argv[optind]);
+		hidraw_name = strrchr(node, '/') != NULL ? strrchr(node, '/') + 1 : node;
+		model = hidraw_model(hidraw_name);
+		if(model == NULL) {
+			fprintf(stderr, "%s is not a DualSense or DualShock 4 connected over USB.\n", node);
+			return 1;
+		}
+	}
+	else {
+		model = find_controller(node, sizeof(node));
+		if(model == NULL) {
+			fprintf(stderr, "No DualSense or DualShock 4 connected over USB found.\n");
+			return 1;
+		}
+		hidraw_name = strrchr(node, '/') + 1;
+	}
+
+	int fd = open(node, O_RDONLY | (busy_poll ? O_NONBLOCK : 0));
+	if(fd < 0) {
+		fprintf(stderr, "Could not open %s: %s\n", node, strerror(errno));
+		return 1;
+	}
+
+	int epoll_fd = -1;
+	if(!busy_poll) {
+		struct epoll_event event = { .events = EPOLLIN, .data.fd = fd };
+
+		epoll_fd = epoll_create1(0);
+		if(epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+			fprintf(stderr, "Could not set up epoll: %s\n", strerror(errno));
+			return 1;
+		}
+	}
+
+	signal(SIGINT, &on_signal);
+	signal(SIGTERM, &on_signal);
+
+	printf("Measuring %s on %s for %.1f s%s, Ctrl+C stops early.\n", model->name, node, seconds, busy_poll ? " (busy-polling)" : "");
+
+	bool dualsense = model->type == CONTROLLER_DUALSENSE;
+	size_t report_size = dualsense ? DS_REPORT_SIZE : DS4_REPORT_SIZE;
+	unsigned int seq_modulo = dualsense ? 256 : 64;
+	uint64_t timestamp_modulo = dualsense ? (1ull << 32) : (1ull << 16);
+
+	size_t capacity = 1 << 16;
+	struct sample* samples = malloc(capacity * sizeof(*samples));
+	size_t count = 0;
+	size_t reports = 0;
+	size_t duplicates = 0;
+	size_t dropped = 0;
+	size_t other = 0;
+	unsigned int last_seq = 0;
+	uint64_t last_timestamp = 0;
+	uint64_t device_ticks = 0;
+	uint64_t start = now_ns();
+	uint64_t end = start + (uint64_t)(seconds * 1e9);
+
+	if(samples == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	while(!stop && now_ns() < end && (max_reports == 0 || reports < max_reports)) {
+		uint8_t data[MAX_REPORT_SIZE];
+		ssize_t len;
+		uint64_t host_ns;
+
+		if(!busy_poll) {
+			struct epoll_event event;
+			uint64_t now = now_ns();
+			uint64_t remaining_ms;
+
+			/* The unsigned subtraction below would wrap once the deadline passed between the loop check and here. */
+			if(now >= end) {
+				break;
+			}
+			remaining_ms = (end - now) / 1000000 + 1;
+			if(remaining_ms > INT_MAX) {
+				remaining_ms = INT_MAX;
+			}
+
+			int ready = epoll_wait(epoll_fd, &event, 1, (int)remaining_ms);
+			if(ready < 0 && errno == EINTR) {
+				continue;
+			}
+			if(ready < 0) {
+				fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+				break;
+			}
+			if(ready == 0) {
+				continue;
+			}
+		}
+
+		len = read(fd, data, sizeof(data));
+		host_ns = now_ns();
+
+		if(len < 0) {
+			if(errno == EAGAIN || errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "Read from %s failed: %s\n", node, strerror(errno));
+			break;
+		}
+
+		if((size_t)len < report_size || data[0] != (dualsense ? DS_REPORT_ID : DS4_REPORT_ID)) {
+			other++;
+			continue;
+		}
+
+		unsigned int seq = dualsense ? data[DS_SEQ_OFFSET] : data[DS4_SEQ_OFFSET] >> 2;
+		uint64_t timestamp = dualsense ?
+			(uint64_t)data[DS_TIMESTAMP_OFFSET] | (uint64_t)data[DS_TIMESTAMP_OFFSET + 1] << 8 | (uint64_t)data[DS_TIMESTAMP_OFFSET + 2] << 16 |
+				(uint64_t)data[DS_TIMESTAMP_OFFSET + 3] << 24 :
+			(uint64_t)data[DS4_TIMESTAMP_OFFSET] | (uint64_t)data[DS4_TIMESTAMP_OFFSET + 1] << 8;
+
+		if(reports > 0) {
+			unsigned int gap = (seq + seq_modulo - last_seq) % seq_modulo;
+
+			/* The same counter means the host polled faster than the controller produced a new report. */
+			if(gap == 0) {
+				duplicates++;
+				reports++;
+				continue;
+			}
+			dropped += gap - 1;
+
+			device_ticks += (timestamp + timestamp_modulo - last_timestamp) % timestamp_modulo;
+		}
+
+		last_seq = seq;
+		last_timestamp = timestamp;
+		reports++;
+
+		if(count == capacity) {
+			struct sample* grown = realloc(samples, capacity * 2 * sizeof(*samples));
+			if(grown == NULL) {
+				fprintf(stderr, "Out of memory, stopping.\n");
+				break;
+			}
+			samples = grown;
+			capacity *= 2;
+		}
+
+		/* DualSense ticks are 1/3 us, DualShock 4 ticks 16/3 us. */
+		samples[count].host_ns = host_ns;
+		samples[count].device_ns = dualsense ? device_ticks * 1000 / 3 : device_ticks * 16000 / 3;
+		count++;
+	}
+
+	uint64_t elapsed_ns = now_ns() - start;
+
+	close(fd);
+	if(epoll_fd >= 0) {
+		close(epoll_fd);
+	}
+
+	printf("\n");
+	print_configuration(hidraw_name);
+	printf("\n");
+
+	if(count < 2) {
+		printf("Not enough reports received (%zu). Is the controller connected and awake?\n", reports);
+		free(samples);
+		return 1;
+	}
+
+	double span_s = (double)(samples[count - 1].host_ns - samples[0].host_ns) / 1e9;
+	size_t intervals = count - 1;
+	uint64_t* deltas = malloc(intervals * sizeof(*deltas));
+	int64_t* skew = malloc(count * sizeof(*skew));
+
+	if(deltas == NULL || skew == NULL) {
+		fprintf(stderr, "Out of memory.\n");
+		return 1;
+	}
+
+	double sum = 0;
+	double sum_sq = 0;
+	for(size_t i = 0; i < intervals; i++) {
+		deltas[i] = samples[i + 1].host_ns - samples[i].host_ns;
+		sum += (double)deltas[i];
+		sum_sq += (double)deltas[i] * (double)deltas[i];
+	}
+	double mean = sum / (double)intervals;
+	double stddev = sqrt(fmax(sum_sq / (double)intervals - mean * mean, 0));
+	qsort(deltas, intervals, sizeof(*deltas), &compare_u64);
+
+	/*
+	 * Delivery skew: arrival time minus the controller's own timestamp. Its drift is the clock rate difference, removed by a
+	 * straight line through the first and last sample. What remains is how much later than usual each report got to userspace.
+	 */
+	double drift = samples[count - 1].device_ns != 0 ?
+		((double)(samples[count - 1].host_ns - samples[0].host_ns) - (double)samples[count - 1].device_ns) / (double)samples[count - 1].device_ns : 0;
+	int64_t min_skew = INT64_MAX;
+	for(size_t i = 0; i < count; i++) {
+		double expected = (double)samples[i].device_ns * (1.0 + drift);
+
+		skew[i] = (int64_t)((double)(samples[i].host_ns - samples[0].host_ns) - expected);
+		if(skew[i] < min_skew) {
+			min_skew = skew[i];
+		}
+	}
+	for(size_t i = 0; i < count; i++) {
+		skew[i] -= min_skew;
+	}
+	qsort(skew, count, sizeof(*skew), &compare_s64);
+
+	printf("Reports:             %zu in %.2f s (%zu duplicate, %zu dropped, %zu other)\n", reports, (double)elapsed_ns / 1e9, duplicates, dropped, other);
+	printf("Rate:                %.1f Hz unique, %.1f Hz including duplicates\n", (double)intervals / span_s, (double)(reports - 1) / span_s);
+	printf("Controller clock:    %.1f reports/s by sensor timestamp, drift %+.1f ppm\n",
+		samples[count - 1].device_ns != 0 ? (double)intervals * 1e9 / (double)samples[count - 1].device_ns : 0.0, drift * 1e6);
+	printf("Interval (us):       mean %.1f, stddev %.1f\n", mean / 1e3, stddev / 1e3);
+
+	static const double percents[] = { 0, 50, 90, 99, 99.9, 100 };
+	static const char* const labels[] = { "min", "p50", "p90", "p99", "p99.9", "max" };
+
+	printf("Interval jitter (us):");
+	for(size_t i = 0; i < sizeof(percents) / sizeof(percents[0]); i++) {
+		printf(" %s %.1f", labels[i], (double)deltas[percentile_index(intervals, percents[i])] / 1e3);
+	}
+	printf("\n");
+
+	printf("Delivery skew (us):  ");
+	for(size_t i = 1; i < sizeof(percents) / sizeof(percents[0]); i++) {
+		printf(" %s %.1f", labels[i], (double)skew[percentile_index(count, percents[i])] / 1e3);
+	}
+	printf("\n");
+
+	free(deltas);
+	free(skew);
+	free(samples);
+
+	return 0;
+}